@@ -7,11 +7,17 @@
 #include "../test/host_node.hpp"
 #include "../ext2/filesystem.hpp"
 #include "../ext2/visitors.hpp"
+#include "../ext2/host_io.hpp"
+#include <atomic>
+#include <fcntl.h>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 namespace po = boost::program_options;
 namespace bfs = boost::filesystem;
 
-template <typename Dir> void copy_file(Dir *dir, const bfs::path &source) {
+template <typename Dir> void copy_file(Dir *dir, const bfs::path &source, int image_fd) {
 	if(!bfs::exists(source)) {
 		std::cerr << source << " not found.\n";
 		exit(1);
@@ -22,60 +28,57 @@ template <typename Dir> void copy_file(Dir *dir, const bfs::path &source) {
 	}
 
 	std::string filename = source.filename().string();
-	auto entries = dir->read_entries();
-	if(ext2::find_entry_by_name(entries, filename) != entries.end()) {
+	if(dir->lookup(filename) != 0) {
 		std::cerr << filename << " is already in the image.\n";
 		exit(1);
 	}
 
-	bfs::ifstream is(source, std::ios::in | std::ios::binary);
-	if (is.is_open()) {
-		auto id_file = dir->fs()->create_file();
-		ext2::detail::device_stream<decltype(id_file.second)> os(&id_file.second);
-		std::array<char, 1024> buffer;
-		while (!is.read(buffer.data(), buffer.size()).eof()) {
-			os.write(buffer.data(), buffer.size());
-		}
-		if (is.gcount() > 0) {
-			os.write(buffer.data(), is.gcount());
-		}
-		auto entry = ext2::create_directory_entry(filename, id_file.first, id_file.second);
-		*dir << entry;
-	} else {
-		std::cerr << "error: could not open " << source << std::endl;
+	try {
+		ext2::import_file(*dir, filename, source.string(), image_fd);
+	} catch (const ext2::error::host_io_error &) {
+		std::cerr << "error: could not copy " << source << std::endl;
 		exit(1);
 	}
 }
 
-template <typename Dir> void copy_to_image(uint32_t inode_id, Dir *target_dir, const bfs::path &source) {
+/*
+ * if jobs is set, regular files are only created and their data is copied later by the jobs.
+ * The directory is read once and all new entries are added at the end with one insert_batch().
+ */
+template <typename Dir> void copy_to_image(uint32_t inode_id, Dir *target_dir, const bfs::path &source, int image_fd, std::vector<ext2::import_job> *jobs) {
+
+	std::unordered_map<std::string, uint32_t> existing;
+	for (const auto &e : target_dir->entries()) {
+		existing.emplace(e.name.to_string(), e.inode_id);
+	}
+	ext2::directory_entry_list batch;
 
-	bfs::directory_iterator end_iter;
-	for (bfs::directory_iterator dir_iter(source); dir_iter != end_iter; ++dir_iter) {
+	// the entries are created in a deterministic order
+	std::vector<bfs::directory_entry> sorted{bfs::directory_iterator(source), bfs::directory_iterator()};
+	std::sort(sorted.begin(), sorted.end());
+	for (auto dir_iter = sorted.begin(); dir_iter != sorted.end(); ++dir_iter) {
+		const std::string name = dir_iter->path().filename().string();
+		auto iter = existing.find(name);
 
 		if (bfs::is_symlink(*dir_iter)) {
-			auto entries = target_dir->read_entries();
-			auto iter = ext2::find_entry_by_name(entries, dir_iter->path().filename().string());
-			if (iter != entries.end()) {
+			if (iter != existing.end()) {
 				std::cout << "delete old version of: " << dir_iter->path() << std::endl;
-				if (!target_dir->fs()->get_inode(iter->inode_id).is_symbolic_link()) {
+				if (!target_dir->fs()->get_inode(iter->second).is_symbolic_link()) {
 					std::cerr << dir_iter->path() << " is not a file." << std::endl;
 				}
-				target_dir->remove(iter->name);
+				target_dir->remove(name);
 			}
 			std::cout << "creating: " << dir_iter->path() << std::endl;
 			bfs::path target = bfs::read_symlink(*dir_iter);
 			auto id_file = target_dir->fs()->create_symbolic_link(target.string());
-			auto entry = ext2::create_directory_entry(dir_iter->path().filename().string(), id_file.first, id_file.second);
-			*target_dir << entry;
+			batch.push_back(ext2::create_directory_entry(name, id_file.first, id_file.second));
 
 		} else if (bfs::is_directory(dir_iter->status())) {
-			auto entries = target_dir->read_entries();
-			auto iter = ext2::find_entry_by_name(entries, dir_iter->path().filename().string());
-			if (iter != entries.end()) {
+			if (iter != existing.end()) {
 				std::cout << "found: " << dir_iter->path() << std::endl;
-				auto inode = target_dir->fs()->get_inode(iter->inode_id);
+				auto inode = target_dir->fs()->get_inode(iter->second);
 				if (auto *d = ext2::to_directory(&inode)) {
-					copy_to_image(iter->inode_id, d, dir_iter->path());
+					copy_to_image(iter->second, d, dir_iter->path(), image_fd, jobs);
 				} else {
 					std::cerr << dir_iter->path() << " is not a directory." << std::endl;
 					exit(1);
@@ -83,44 +86,65 @@ template <typename Dir> void copy_to_image(uint32_t inode_id, Dir *target_dir, c
 			} else {
 				std::cout << "creating: " << dir_iter->path() << std::endl;
 				auto id_dir = target_dir->fs()->create_directory(inode_id);
-				auto entry = ext2::create_directory_entry(dir_iter->path().filename().string(), id_dir.first, id_dir.second);
-				*target_dir << entry;
+				batch.push_back(ext2::create_directory_entry(name, id_dir.first, id_dir.second));
+				id_dir.second.flush();
 				if (auto *d = ext2::to_directory(&id_dir.second)) {
-					copy_to_image(id_dir.first, d, dir_iter->path());
+					copy_to_image(id_dir.first, d, dir_iter->path(), image_fd, jobs);
 				}
 			}
 
 		} else if (bfs::is_regular_file(dir_iter->status())) {
-			auto entries = target_dir->read_entries();
-			auto iter = ext2::find_entry_by_name(entries, dir_iter->path().filename().string());
-			if (iter != entries.end()) {
+			if (iter != existing.end()) {
 				std::cout << "delete old version of: " << dir_iter->path() << std::endl;
-				if (!target_dir->fs()->get_inode(iter->inode_id).is_regular_file()) {
+				if (!target_dir->fs()->get_inode(iter->second).is_regular_file()) {
 					std::cerr << dir_iter->path() << " is not a file." << std::endl;
 					exit(1);
 				}
-				target_dir->remove(iter->name);
+				target_dir->remove(name);
 			}
-			bfs::ifstream is(dir_iter->path(), std::ios::in | std::ios::binary);
-			if (is.is_open()) {
-				std::cout << "creating: " << dir_iter->path() << std::endl;
-				auto id_file = target_dir->fs()->create_file();
-				ext2::detail::device_stream<decltype(id_file.second)> os(&id_file.second);
-				std::array<char, 1024> buffer;
-				while (!is.read(buffer.data(), buffer.size()).eof()) {
-					os.write(buffer.data(), buffer.size());
-				}
-				if (is.gcount() > 0) {
-					os.write(buffer.data(), is.gcount());
+			std::cout << "creating: " << dir_iter->path() << std::endl;
+			try {
+				if (jobs != nullptr) {
+					jobs->push_back(ext2::prepare_import(*target_dir, name, dir_iter->path().string(), &batch));
+				} else {
+					ext2::import_file(*target_dir, name, dir_iter->path().string(), image_fd, &batch);
 				}
-
-				auto entry = ext2::create_directory_entry(dir_iter->path().filename().string(), id_file.first, id_file.second);
-				*target_dir << entry;
-			} else {
-				std::cerr << "warning: could not open " << dir_iter->path() << std::endl;
+			} catch (const ext2::error::host_io_error &) {
+				std::cerr << "warning: could not copy " << dir_iter->path() << std::endl;
 			}
 		}
 	}
+	target_dir->insert_batch(batch);
+}
+
+/*
+ * copies the data of the prepared files with the given number of threads. Files which could not be copied are removed again.
+ */
+template <typename Filesystem> void run_imports(Filesystem &filesystem, const std::vector<ext2::import_job> &import_jobs, int image_fd, unsigned jobs) {
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> threads;
+	std::mutex failed_mutex;
+	std::vector<size_t> failed;
+	for (auto i = 0u; i < jobs; i++) {
+		threads.emplace_back([&]() {
+			for (auto k = next++; k < import_jobs.size(); k = next++) {
+				try {
+					ext2::run_import(import_jobs[k], image_fd);
+				} catch (const ext2::error::host_io_error &) {
+					std::lock_guard<std::mutex> lock(failed_mutex);
+					failed.push_back(k);
+				}
+			}
+		});
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	// the filesystem is only changed by this thread
+	for (auto k : failed) {
+		std::cerr << "warning: could not copy " << import_jobs[k].host_path << ", it is not in the image" << std::endl;
+		ext2::discard_import(filesystem, import_jobs[k]);
+	}
 }
 
 int main(int ac, char *av[]) {
@@ -128,15 +152,19 @@ int main(int ac, char *av[]) {
 		// int uid;
 		// int gid;
 		int offset;
+		unsigned jobs;
 		po::options_description desc("etools can write into an ext2 image.\nIMPORTENT: All privileges and flags on "
 				"the host system are ignored.\n\n Options");
 		desc.add_options()("help", "produce help message")
 				("image,i", po::value<std::string>(), "the ext2 image")
 				("offset", po::value<int>(&offset)->default_value(0), "ext2 partition offset in bytes")
 				("root,r", po::value<std::string>(), "the root directory which will be copied into the image")
+				("jobs,j", po::value<unsigned>(&jobs)->default_value(1), "number of threads which copy file contents for --root")
 				("mkdir", po::value<std::string>(), "creates a directory")
 				("target-dir,t", po::value<std::string>(), "target direcotry for copy-files")
-				("read-file", po::value<std::string>(), "prints a file to cout")
+				("read-file", po::value<std::string>(), "writes a file to stdout")
+				("extents", po::value<std::string>(), "prints the block extents of a file")
+				("compact", "packs all directories and frees their unused blocks")
 				("dump", "creates a directory")
 				("copy-files,c", po::value<std::vector<std::string>>()->composing(), "copys a list of files into target-dir");
 		/*("uid", po::value<int>(&uid)->default_value(0), "uid for all entries")
@@ -174,6 +202,8 @@ int main(int ac, char *av[]) {
 				std::cerr << image << " that is not a ext2 filesystem image.\n";
 				return 1;
 			}
+			// file contents are copied by the kernel, if possible
+			int image_fd = ::open(image.string().c_str(), O_RDWR);
 
 			if (vm.count("mkdir")) {
 				std::string path_str = vm["mkdir"].as<std::string>();
@@ -196,8 +226,7 @@ int main(int ac, char *av[]) {
 				}
 				auto inode = filesystem.get_inode(inodeid);
 				if (auto *d = ext2::to_directory(&inode)) {
-					auto entries = d->read_entries();
-					if (ext2::find_entry_by_name(entries, dirname) != entries.end()) {
+					if (d->lookup(dirname) != 0) {
 						std::cerr << path_str << " already exists.\n";
 						return 1;
 					}
@@ -223,7 +252,13 @@ int main(int ac, char *av[]) {
 				std::cout << dir << " => " << image << "\n";
 				auto r = filesystem.get_root();
 				if (auto *d = ext2::to_directory(&r)) {
-					copy_to_image(2, d, dir); // 2 is always the inode id of "/"
+					if (jobs > 1 && image_fd >= 0) {
+						std::vector<ext2::import_job> import_jobs;
+						copy_to_image(2, d, dir, image_fd, &import_jobs); // 2 is always the inode id of "/"
+						run_imports(filesystem, import_jobs, image_fd, jobs);
+					} else {
+						copy_to_image(2, d, dir, image_fd, nullptr);
+					}
 
 				} else {
 					std::cerr << "Error on reading root direcotry in " << image << std::endl;
@@ -248,7 +283,7 @@ int main(int ac, char *av[]) {
 						std::vector<std::string> files = vm["copy-files"].as<std::vector<std::string>>();
 						for(const auto& file : files) {
 							std::cout << "copy: " << file << std::endl;
-							copy_file(d, file);
+							copy_file(d, file, image_fd);
 						}
 					} else {
 						std::cerr << "error: " << path << " is not a directory.\n";
@@ -259,6 +294,11 @@ int main(int ac, char *av[]) {
 					return 1;
 				}
 			}
+			if (vm.count("compact")) {
+				auto root = filesystem.get_root();
+				auto freed = ext2::compact_directories(root);
+				std::cout << "compact: " << freed << " block(s) freed\n";
+			}
 			if (vm.count("dump")) {
 				filesystem.dump(std::cout);
 				std::cout << "\n\nContent:\n\n";
@@ -276,12 +316,37 @@ int main(int ac, char *av[]) {
 				}
 				auto inode = filesystem.get_inode(inodeid);
 				if(auto* file = ext2::to_file(&inode)) {
-					std::cout << *file;
-
+					std::cout.flush();
+					ext2::copy_to_fd(*file, STDOUT_FILENO, image_fd);
 				} else {
 					std::cerr << path << " is not a file.\n";
 				}
 			}
+			if(vm.count("extents")) {
+				std::string path = vm["extents"].as<std::string>(); 
+				auto root = filesystem.get_root();
+				auto inodeid = ext2::find_inode(root, path);
+				if(inodeid == 0) {
+					std::cerr << path << " not found.\n";
+					return 1;
+				}
+				auto inode = filesystem.get_inode(inodeid);
+				auto extents = inode.map_extents(0, inode.size());
+				auto fragments = 0u;
+				for(const auto& e : extents) {
+					std::cout << e.logical << '-' << e.logical + e.length - 1 << ": ";
+					if(e.physical == 0) {
+						std::cout << "hole\n";
+					} else {
+						std::cout << e.physical << '-' << e.physical + e.length - 1 << '\n';
+						fragments++;
+					}
+				}
+				std::cout << path << ": " << fragments << " extent(s)\n";
+			}
+			if (image_fd >= 0) {
+				::close(image_fd);
+			}
 		} else {
 			std::cerr << "ext2 image was not set.\n";
 		}
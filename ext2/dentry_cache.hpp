@@ -0,0 +1,122 @@
+/*
+*
+*	Author: Philipp Zschoche, https://zschoche.org
+*
+*/
+#ifndef __DENTRY_CACHE_HPP__
+#define __DENTRY_CACHE_HPP__
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+namespace ext2 {
+
+/*
+ * maps (directory inode, name) to the inode of the entry. An inode id of 0 is a negative entry: the directory has no such name.
+ * The least recently used entries are evicted as soon as the capacity is exceeded.
+ */
+class dentry_cache {
+	struct entry {
+		uint32_t parent;
+		std::string name;
+		uint32_t id;
+	};
+	typedef std::list<entry>::iterator iterator;
+
+      public:
+	dentry_cache(size_t capacity = 4096) : _capacity(capacity) {}
+	/* cached entries belong to exactly one filesystem, therefore a copy starts empty */
+	dentry_cache(const dentry_cache &other) : _capacity(other._capacity) {}
+	dentry_cache &operator=(const dentry_cache &other) {
+		clear();
+		_capacity = other._capacity;
+		return *this;
+	}
+
+	/*
+	 * returns false on a miss. Otherwise id is the inode of the entry or 0, if there is no such entry.
+	 */
+	bool find(uint32_t parent, const std::string &name, uint32_t &id) {
+		auto dir = map.find(parent);
+		if (dir == map.end()) {
+			return false;
+		}
+		auto iter = dir->second.find(name);
+		if (iter == dir->second.end()) {
+			return false;
+		}
+		lru.splice(lru.begin(), lru, iter->second);
+		id = iter->second->id;
+		return true;
+	}
+
+	/* adds or replaces an entry, id 0 adds a negative entry */
+	void insert(uint32_t parent, const std::string &name, uint32_t id) {
+		auto &dir = map[parent];
+		auto iter = dir.find(name);
+		if (iter != dir.end()) {
+			iter->second->id = id;
+			lru.splice(lru.begin(), lru, iter->second);
+			return;
+		}
+		lru.push_front(entry{parent, name, id});
+		dir.emplace(name, lru.begin());
+		shrink();
+	}
+
+	void erase(uint32_t parent, const std::string &name) {
+		auto dir = map.find(parent);
+		if (dir != map.end()) {
+			auto iter = dir->second.find(name);
+			if (iter != dir->second.end()) {
+				lru.erase(iter->second);
+				dir->second.erase(iter);
+				if (dir->second.empty()) {
+					map.erase(dir);
+				}
+			}
+		}
+	}
+
+	/* forgets all entries of the directory parent */
+	void erase_directory(uint32_t parent) {
+		auto dir = map.find(parent);
+		if (dir != map.end()) {
+			for (auto &item : dir->second) {
+				lru.erase(item.second);
+			}
+			map.erase(dir);
+		}
+	}
+
+	void clear() {
+		lru.clear();
+		map.clear();
+	}
+
+	inline size_t size() const { return lru.size(); }
+	inline size_t capacity() const { return _capacity; }
+	void set_capacity(size_t capacity) {
+		_capacity = capacity;
+		shrink();
+	}
+
+      private:
+	size_t _capacity;
+	std::list<entry> lru;
+	std::unordered_map<uint32_t, std::unordered_map<std::string, iterator> > map;
+
+	void shrink() {
+		while (lru.size() > _capacity) {
+			const auto parent = lru.back().parent;
+			const auto name = lru.back().name;
+			erase(parent, name);
+		}
+	}
+};
+
+} /* namespace ext2 */
+
+#endif /* __DENTRY_CACHE_HPP__ */
@@ -34,21 +34,21 @@ template <typename Device> void zeroing_device(Device &device, uint64_t offset,
 
 template <typename Device> struct device_stream {
 
-	device_stream(Device *d, uint32_t offset = 0) : d(d), offset(offset) {}
+	device_stream(Device *d, uint64_t offset = 0) : d(d), offset(offset) {}
 
 	void write(const char *buffer, uint64_t size) {
 		d->write(offset, buffer, size);
 		offset += size;
 	}
 
-	void read(char *buffer, uint64_t size) const {
+	void read(char *buffer, uint64_t size) {
 		d->read(offset, buffer, size);
 		offset += size;
 	}
 
       private:
 	Device *d;
-	uint32_t offset;
+	uint64_t offset;
 };
 
 template<typename Device> device_stream<Device>& operator<<(device_stream<Device>& os, const std::string& str) {
@@ -63,7 +63,7 @@ template<typename Device> device_stream<Device>& operator<<(device_stream<Device
 	return os;
 }
 
-template <typename Device> device_stream<Device> get_device_stream(Device* device, uint32_t offset = 0) {
+template <typename Device> device_stream<Device> get_device_stream(Device* device, uint64_t offset = 0) {
 	return device_stream<Device>(device, offset);
 }
 
@@ -157,6 +157,7 @@ template <typename Device> class bitmap : dynamic_block_data<Device> {
 	}
 };
 template <typename Device> using superblock = block_data<Device, detail::superblock>;
+template <typename Device> using superblock_extension = block_data<Device, detail::superblock_extension>;
 template <typename Device> using group_descriptor = block_data<Device, detail::group_descriptor>;
 template <typename Device> using group_descriptor_table = std::vector<group_descriptor<Device> >;
 
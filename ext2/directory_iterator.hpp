@@ -0,0 +1,175 @@
+/*
+*
+*	Author: Philipp Zschoche, https://zschoche.org
+*
+*/
+#ifndef __DIRECTORY_ITERATOR_HPP__
+#define __DIRECTORY_ITERATOR_HPP__
+
+#include "structs.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+namespace ext2 {
+
+namespace detail {
+
+/*
+ * a used directory entry inside a buffer. The name points into the buffer and is only valid as long as the buffer is.
+ */
+struct directory_entry_ref {
+	uint32_t inode_id;
+	uint16_t size;
+	uint8_t name_size;
+	directory_entry_type::directory_entry_type type;
+	boost::string_ref name;
+
+	directory_entry to_entry() const { return directory_entry{inode_id, size, name_size, type, name.to_string()}; }
+};
+
+/*
+ * moves offset behind the next used entry of one directory block and returns true, or false at the end of the block.
+ * Entries never cross the end of a block, a corrupted entry ends the block.
+ */
+inline bool next_directory_entry(const char *block, uint32_t length, uint32_t &offset, directory_entry_ref &entry) {
+	while (offset + 8 <= length) {
+		const char *current = block + offset;
+		std::memcpy(&entry.inode_id, current, 4);
+		std::memcpy(&entry.size, current + 4, 2);
+		entry.name_size = current[6];
+		entry.type = static_cast<directory_entry_type::directory_entry_type>(current[7]);
+		if (entry.size < 8 || offset + entry.size > length || 8u + entry.name_size > entry.size) {
+			offset = length;
+			return false;
+		}
+		offset += entry.size;
+		if (entry.inode_id != 0) {
+			entry.name = boost::string_ref(current + 8, entry.name_size);
+			return true;
+		}
+	}
+	offset = length;
+	return false;
+}
+
+} /* namespace detail */
+
+/*
+ * forward iterator over the used entries of a directory. The directory is read lazily, blocks_per_read blocks at a time, so a search
+ * which stops early reads only the blocks up to the match. The names point into the buffer of the iterator and are invalidated by
+ * advancing it. The directory must not change during the iteration.
+ *
+ * cookie() is a position behind the current entry: an iteration started at the cookie continues with the first entry behind it.
+ * Like the offsets of ext2 readdir(), it is the logical block and the offset in it. Adding and removing entries does not move the others,
+ * so a paused iteration neither skips nor repeats them. Moved entries are not covered: the split of a full leaf of an indexed directory
+ * moves the upper half into a new block, where these entries may be seen again, and compact(), build_index() and write_entries()
+ * rewrite the whole directory.
+ */
+template <typename Directory> class directory_iterator {
+      public:
+	typedef std::forward_iterator_tag iterator_category;
+	typedef detail::directory_entry_ref value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef const value_type *pointer;
+	typedef const value_type &reference;
+
+	static constexpr uint32_t blocks_per_read = 8;
+
+	/* the end iterator */
+	directory_iterator() : dir(nullptr), buffer_offset(0), offset(0), block_size(0) {}
+	/* the first entry at or behind cookie */
+	directory_iterator(const Directory *dir, uint64_t cookie = 0) : dir(dir), buffer_offset(0), offset(0), block_size(dir->fs()->block_size()) {
+		// the cookie may point into an entry, which was merged by a removal. The block is parsed from its beginning.
+		buffer_offset = cookie - (cookie % block_size);
+		fill();
+		do {
+			advance();
+		} while (this->dir != nullptr && position() < cookie);
+	}
+
+	inline reference operator*() const { return current; }
+	inline pointer operator->() const { return &current; }
+
+	directory_iterator &operator++() {
+		advance();
+		return *this;
+	}
+	directory_iterator operator++(int) {
+		auto result = *this;
+		advance();
+		return result;
+	}
+
+	/* the offset of the current entry in the directory */
+	inline uint64_t position() const { return buffer_offset + offset - current.size; }
+
+	/* where to continue behind the current entry */
+	inline uint64_t cookie() const { return buffer_offset + offset; }
+
+	friend bool operator==(const directory_iterator &lhs, const directory_iterator &rhs) {
+		if (lhs.dir == nullptr || rhs.dir == nullptr) {
+			return lhs.dir == rhs.dir;
+		}
+		return lhs.dir == rhs.dir && lhs.position() == rhs.position();
+	}
+	friend bool operator!=(const directory_iterator &lhs, const directory_iterator &rhs) { return !(lhs == rhs); }
+
+      private:
+	const Directory *dir;
+	std::vector<char> buffer;
+	uint64_t buffer_offset; // of the buffer in the directory
+	uint32_t offset;	// of the next entry in the buffer
+	uint32_t block_size;
+	value_type current;
+
+	/* reads the next blocks behind the buffer, returns false at the end of the directory */
+	bool fill() {
+		buffer_offset += buffer.size();
+		offset = 0;
+		if (buffer_offset >= dir->size()) {
+			return false;
+		}
+		buffer.resize(std::min<uint64_t>(dir->size() - buffer_offset, static_cast<uint64_t>(block_size) * blocks_per_read));
+		dir->read(buffer_offset, buffer.data(), buffer.size());
+		return true;
+	}
+
+	void advance() {
+		do {
+			while (offset < buffer.size()) {
+				const uint32_t block = offset - (offset % block_size);
+				const uint32_t length = std::min<uint32_t>(block_size, buffer.size() - block);
+				uint32_t in_block = offset - block;
+				const bool found = detail::next_directory_entry(&buffer[block], length, in_block, current);
+				offset = block + in_block;
+				if (found) {
+					return;
+				}
+			}
+		} while (fill());
+		dir = nullptr;
+	}
+};
+
+/*
+ * the entries of a directory as a range for range-based for loops, beginning at a cookie
+ */
+template <typename Directory> class directory_range {
+	const Directory *dir;
+	uint64_t cookie;
+
+      public:
+	typedef directory_iterator<Directory> iterator;
+	typedef iterator const_iterator;
+
+	directory_range(const Directory *dir, uint64_t cookie = 0) : dir(dir), cookie(cookie) {}
+
+	inline iterator begin() const { return iterator(dir, cookie); }
+	inline iterator end() const { return iterator(); }
+};
+
+} /* namespace ext2 */
+
+#endif /* __DIRECTORY_ITERATOR_HPP__ */
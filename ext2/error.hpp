@@ -22,6 +22,12 @@ namespace ext2 {
 		struct file_is_full_error : std::runtime_error {
 			file_is_full_error() : std::runtime_error("file_is_full_error") {}
 		};
+		struct block_size_error : std::runtime_error {
+			block_size_error() : std::runtime_error("block_size_error") {}
+		};
+		struct host_io_error : std::runtime_error {
+			host_io_error() : std::runtime_error("host_io_error") {}
+		};
 		
 	} /* namespace error */
 
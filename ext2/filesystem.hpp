@@ -9,6 +9,8 @@
 #include "device_io.hpp"
 #include "error.hpp"
 #include "inode.hpp"
+#include "dentry_cache.hpp"
+#include "inode_cache.hpp"
 #include <boost/algorithm/string/split.hpp>
 
 namespace ext2 {
@@ -55,16 +57,72 @@ template <typename NotFoundError, typename BitmapVec> uint32_t alloc(BitmapVec &
 	bitmaps[bg_index].save();
 	return result;
 }
+/*
+ * allocates count elements, searching from related_id on. Every touched bitmap is saved once.
+ * returns the allocated elements as runs of (first, length), which hold exactly count elements. If there are fewer free elements,
+ * nothing is allocated and NotFoundError is thrown.
+ */
+template <typename NotFoundError, typename BitmapVec>
+std::vector<std::pair<uint32_t, uint32_t> > alloc_many(BitmapVec &bitmaps, uint32_t elements_per_group, uint32_t count, uint32_t related_id = 0) {
+	std::vector<std::pair<uint32_t, uint32_t> > result;
+	std::vector<bool> touched(bitmaps.size(), false);
+	const uint64_t total = static_cast<uint64_t>(bitmaps.size()) * elements_per_group;
+	uint64_t pos = related_id % total;
+	for (uint64_t i = 0; i < total && count > 0; i++, pos = (pos + 1 == total) ? 0 : pos + 1) {
+		auto bg_index = pos / elements_per_group;
+		auto index = pos % elements_per_group;
+		if (!bitmaps[bg_index].get(index)) {
+			bitmaps[bg_index].set(index, true);
+			touched[bg_index] = true;
+			if (!result.empty() && result.back().first + result.back().second == pos) {
+				result.back().second++;
+			} else {
+				result.emplace_back(pos, 1);
+			}
+			--count;
+		}
+	}
+	if (count > 0) {
+		for (const auto &run : result) {
+			for (auto id = run.first; id < run.first + run.second; id++) {
+				bitmaps[id / elements_per_group].set(id % elements_per_group, false);
+			}
+		}
+		throw NotFoundError();
+	}
+	for (auto i = 0u; i < bitmaps.size(); i++) {
+		if (touched[i]) {
+			bitmaps[i].save();
+		}
+	}
+	return result;
+}
 template <typename BitmapVec> void free(uint32_t id, BitmapVec &bitmaps, uint32_t elements_per_group) {
 	uint32_t bg_index = id / elements_per_group;
 	bitmaps[bg_index].set(id % elements_per_group, false);
 	bitmaps[bg_index].save();
 }
+/*
+ * frees the given elements. Every touched bitmap is saved once.
+ */
+template <typename Container, typename BitmapVec> void free_many(const Container &ids, BitmapVec &bitmaps, uint32_t elements_per_group) {
+	std::vector<bool> touched(bitmaps.size(), false);
+	for (auto id : ids) {
+		uint32_t bg_index = id / elements_per_group;
+		bitmaps[bg_index].set(id % elements_per_group, false);
+		touched[bg_index] = true;
+	}
+	for (auto i = 0u; i < bitmaps.size(); i++) {
+		if (touched[i]) {
+			bitmaps[i].save();
+		}
+	}
+}
 
 } /* namespace allocator */
 
 /*
- * increments the hardlink counter of given inode and peform inode.save()
+ * increments the hardlink counter of given inode and marks it dirty
  */
 template <typename Inode> detail::directory_entry create_directory_entry(const std::string &name, uint32_t inodeid, Inode &inode) {
 	detail::directory_entry result;
@@ -90,19 +148,26 @@ template <typename Inode> detail::directory_entry create_directory_entry(const s
 	}
 	result.name = name;
 	inode.data.count_hard_link++;
-	inode.save();
+	inode.mark_dirty();
 	return result;
 }
 
-template <typename Device> struct filesystem {
+/*
+ * BlockSizeBits is the log2 of the block size (10, 11 or 12 for 1K, 2K or 4K blocks). With 0 the block size of the super block is used,
+ * otherwise all block calculations are shifts and masks by a constant.
+ */
+template <typename Device, uint32_t BlockSizeBits = 0> struct filesystem {
 	typedef typename superblock<Device>::device_type device_type;
-	typedef inode<filesystem<Device> > inode_type;
-	typedef inodes::directory<filesystem<Device> > directory_type;
-	typedef inodes::file<filesystem<Device> > file_type;
-	typedef inodes::symbolic_link<filesystem<Device> > symbolic_link_type;
+	typedef inode<filesystem<Device, BlockSizeBits> > inode_type;
+	typedef inodes::directory<filesystem<Device, BlockSizeBits> > directory_type;
+	typedef inodes::file<filesystem<Device, BlockSizeBits> > file_type;
+	typedef inodes::symbolic_link<filesystem<Device, BlockSizeBits> > symbolic_link_type;
 	typedef group_descriptor_table<Device> gd_table_type;
+	typedef inode_cache<inode_type> inode_cache_type;
+	typedef typename inode_cache_type::handle_type inode_handle_type;
 
-	filesystem(Device &d, uint64_t disk_start = 0) : disk_start(disk_start),super_block(&d, disk_start + 1024) {}
+	filesystem(Device &d, uint64_t disk_start = 0)
+	    : disk_start(disk_start), super_block(&d, disk_start + 1024), super_block_ext(&d, disk_start + 1024 + sizeof(detail::superblock)) {}
 
 	inline device_type *device() { return super_block.device(); }
 	inline const device_type *device() const { return super_block.device(); }
@@ -110,7 +175,11 @@ template <typename Device> struct filesystem {
 	void load() {
 		super_block.load();
 		if (this->is_magic_number_ok()) {
-			blocksize = super_block.data.block_size();
+			blocksize_bits = 10 + super_block.data.block_size_log;
+			if (BlockSizeBits != 0 && BlockSizeBits != blocksize_bits) {
+				throw error::block_size_error();
+			}
+			super_block_ext.load();
 			gd_table = read_group_descriptor_table(super_block);
 			block_bitmaps.reserve(gd_table.size());
 			inode_bitmaps.reserve(gd_table.size());
@@ -127,27 +196,119 @@ template <typename Device> struct filesystem {
 
 	bool is_magic_number_ok() const { return super_block.data.ext2_magic_number == 0xef53; }
 
-	inode_type get_inode(uint32_t inodeid) {
-		auto block_group_id = (inodeid - 1) / super_block.data.inodes_per_group;
-		auto index = (inodeid - 1) % super_block.data.inodes_per_group;
-		auto block_id = (index * super_block.data.inode_size) / block_size();
-		auto block_offset = (index * super_block.data.inode_size) - (block_id * block_size());
-		block_id += gd_table[block_group_id].data.address_inode_table;
-		inode_type result(this, to_address(block_id, block_offset));
-		result.load();
-		return result;
+	/* true, if directories may have a hash tree index */
+	inline bool has_dir_index() const { return detail::has_flag(super_block.data.features_opt, detail::opt_feature_dir_use_hash); }
+
+	/* the hash version of new indexed directories */
+	inline uint8_t default_hash_version() const {
+		return super_block_ext.data.default_hash_version <= htree::tea ? super_block_ext.data.default_hash_version : htree::half_md4;
 	}
-	const inode_type get_inode(uint32_t inodeid) const {
-		auto block_group_id = (inodeid - 1) / super_block.data.inodes_per_group;
-		auto index = (inodeid - 1) % super_block.data.inodes_per_group;
-		auto block_id = (index * super_block.data.inode_size) / block_size();
-		auto block_offset = (index * super_block.data.inode_size) - (block_id * block_size());
-		block_id += gd_table[block_group_id].data.address_inode_table;
-		inode_type result(const_cast<filesystem<Device>*>(this), to_address(block_id, block_offset));
-		result.load();
-		return result;
+
+	/*
+	 * the hash of a name in an indexed directory. version is the hash version of its root,
+	 * the superblock tells whether chars are signed or unsigned.
+	 */
+	uint32_t dir_hash(const std::string &name, uint8_t version) const {
+		if (version <= htree::tea && detail::has_flag(super_block_ext.data.flags, detail::superblock_flag_unsigned_hash)) {
+			version += htree::legacy_unsigned;
+		}
+		uint32_t seed[4];
+		std::memcpy(seed, super_block_ext.data.hash_seed, sizeof(seed));
+		return htree::hash(name.c_str(), name.size(), version, seed);
+	}
+
+	/*
+	 * returns a handle to the cached inode. Changes on a dirty inode are written back when the last handle is released.
+	 */
+	inode_handle_type iget(uint32_t inodeid) {
+		return inodes.get(inodeid, [this](uint32_t id) { return this->read_inode(id); });
+	}
+
+	/*
+	 * returns a copy of the cached inode
+	 */
+	inode_type get_inode(uint32_t inodeid) { return *iget(inodeid); }
+	const inode_type get_inode(uint32_t inodeid) const { return *const_cast<filesystem<Device, BlockSizeBits> *>(this)->iget(inodeid); }
+
+	/*
+	 * reads the inodes [first, first + count) with one device read per block group and puts them into the cache
+	 */
+	void load_inodes(uint32_t first, uint32_t count) {
+		const auto per_group = super_block.data.inodes_per_group;
+		const auto inode_size = super_block.data.inode_size;
+		std::vector<char> buffer;
+		while (count > 0) {
+			auto block_group_id = (first - 1) / per_group;
+			auto index = (first - 1) % per_group;
+			auto length = std::min(count, per_group - index);
+			buffer.resize(length * inode_size);
+			auto address = to_address(gd_table[block_group_id].data.address_inode_table, 0) + (index * inode_size);
+			device()->read(address, buffer.data(), buffer.size());
+			for (auto i = 0u; i < length; i++) {
+				if (inodes.find(first + i) == nullptr) {
+					inode_type inode(this, first + i, address + (i * inode_size));
+					std::memcpy(&inode.data, &buffer[i * inode_size], sizeof(inode.data));
+					inodes.insert(first + i, std::move(inode));
+				}
+			}
+			first += length;
+			count -= length;
+		}
+	}
+	void load_inodes(uint32_t first, uint32_t count) const { const_cast<filesystem<Device, BlockSizeBits> *>(this)->load_inodes(first, count); }
+
+	/*
+	 * loads the given inodes in inode table order. Inodes in the same or in adjacent inode table blocks are read at once.
+	 */
+	template <typename Container> void prefetch_inodes(Container ids) {
+		std::sort(ids.begin(), ids.end());
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+		ids.erase(std::remove_if(ids.begin(), ids.end(), [this](uint32_t id) { return id == 0 || inodes.find(id) != nullptr; }), ids.end());
+		if (ids.size() > inodes.capacity()) {
+			ids.resize(inodes.capacity());
+		}
+		const auto per_group = super_block.data.inodes_per_group;
+		const auto per_block = block_size() / super_block.data.inode_size;
+		auto table_block = [&](uint32_t id) { return (id - 1) / per_block; }; // inode tables of different groups never touch
+		auto iter = ids.begin();
+		while (iter != ids.end()) {
+			auto first = *iter;
+			auto last = first;
+			while (++iter != ids.end() && (*iter - 1) / per_group == (first - 1) / per_group && table_block(*iter) <= table_block(last) + 1) {
+				last = *iter;
+			}
+			load_inodes(first, last - first + 1);
+		}
+	}
+	template <typename Container> void prefetch_inodes(Container ids) const { const_cast<filesystem<Device, BlockSizeBits> *>(this)->prefetch_inodes(std::move(ids)); }
+
+	/*
+	 * called by inode::save() and inode::load() to keep the cached copy in sync. The indirect blocks of the cached copy are dropped,
+	 * the other copy may have freed them.
+	 */
+	void update_cached_inode(const inode_type &inode) {
+		auto *e = inodes.find(inode.id());
+		if (e != nullptr && &e->inode != &inode) {
+			e->inode.data = inode.data;
+			e->inode.drop_indirect_blocks();
+		}
 	}
 
+	inline size_t inode_cache_capacity() const { return inodes.capacity(); }
+	inline void set_inode_cache_capacity(size_t capacity) { inodes.set_capacity(capacity); }
+
+	/*
+	 * the cache of directory entries, which is used by directory::lookup(). A lookup of a const directory fills it, too.
+	 */
+	inline dentry_cache &dcache() const { return dentries; }
+	inline size_t dentry_cache_capacity() const { return dentries.capacity(); }
+	inline void set_dentry_cache_capacity(size_t capacity) { dentries.set_capacity(capacity); }
+
+	/*
+	 * writes back all dirty inodes
+	 */
+	void sync() { inodes.flush(); }
+
 	inode_type get_root() { return get_inode(2); }
 	const inode_type get_root() const { return get_inode(2); }
 
@@ -164,6 +325,38 @@ template <typename Device> struct filesystem {
 		return result;
 	}
 
+	/*
+	 * allocates count blocks near related_block_id. Every touched bitmap, group descriptor and the superblock are saved once.
+	 * returns the blocks as runs, extent::logical is the position in the allocation. Either all count blocks are allocated or
+	 * none and no_free_block_error is thrown.
+	 */
+	extent_list alloc_blocks(uint32_t count, uint32_t related_block_id = 1) {
+		extent_list result;
+		if (count == 0) {
+			return result;
+		}
+		related_block_id--; // bit 0 is corresponding with block 1
+		auto runs = allocator::alloc_many<error::no_free_block_error>(block_bitmaps, super_block.data.blocks_per_group, count, related_block_id);
+		std::vector<uint32_t> allocated(gd_table.size(), 0);
+		uint32_t logical = 0;
+		for (const auto &run : runs) {
+			for (auto id = run.first; id < run.first + run.second; id++) {
+				allocated[(id + 1) / super_block.data.blocks_per_group]++;
+			}
+			result.push_back(extent{logical, run.first + 1, run.second}); // bit 0 is corresponding with block 1
+			logical += run.second;
+		}
+		for (auto i = 0u; i < gd_table.size(); i++) {
+			if (allocated[i] > 0) {
+				gd_table[i].data.free_blocks -= allocated[i];
+				gd_table[i].save();
+			}
+		}
+		super_block.data.free_block_count -= count;
+		super_block.save();
+		return result;
+	}
+
 	void free_block(uint32_t id) {
 		auto gdt_id = id / super_block.data.blocks_per_group;
 		id--; // bit 0 is corresponding with block 1
@@ -174,6 +367,30 @@ template <typename Device> struct filesystem {
 		super_block.save();
 	}
 
+	/*
+	 * frees the given blocks. Every touched bitmap, group descriptor and the superblock are saved once.
+	 */
+	void free_blocks(std::vector<uint32_t> ids) {
+		if (ids.empty()) {
+			return;
+		}
+		std::sort(ids.begin(), ids.end());
+		std::vector<uint32_t> released(gd_table.size(), 0);
+		for (auto &id : ids) {
+			released[id / super_block.data.blocks_per_group]++;
+			id--; // bit 0 is corresponding with block 1
+		}
+		allocator::free_many(ids, block_bitmaps, super_block.data.blocks_per_group);
+		for (auto i = 0u; i < gd_table.size(); i++) {
+			if (released[i] > 0) {
+				gd_table[i].data.free_blocks += released[i];
+				gd_table[i].save();
+			}
+		}
+		super_block.data.free_block_count += ids.size();
+		super_block.save();
+	}
+
 	uint32_t alloc_inode(uint32_t related_inode_id = 1) {
 		related_inode_id--; // bit 0 is corresponding with block 1
 		uint32_t result = allocator::alloc<error::no_free_inode_error>(inode_bitmaps, super_block.data.inodes_per_group, related_inode_id);
@@ -187,6 +404,7 @@ template <typename Device> struct filesystem {
 	}
 
 	void free_inode(uint32_t id) {
+		dentries.erase_directory(id);
 		id--; // bit 0 is corresponding with block 1
 		auto gdt_id = id / super_block.data.inodes_per_group;
 		allocator::free(id, inode_bitmaps, super_block.data.inodes_per_group);
@@ -196,9 +414,10 @@ template <typename Device> struct filesystem {
 		super_block.save();
 	}
 
-	inline uint64_t to_address(uint32_t blockid, uint32_t block_offset) const { return disk_start + (blockid * block_size()) + block_offset; }
+	inline uint64_t to_address(uint32_t blockid, uint32_t block_offset) const { return disk_start + (static_cast<uint64_t>(blockid) << block_size_bits()) + block_offset; }
 	inline bool large_files() const { return super_block.data.large_files(); }
-	inline uint32_t block_size() const { return blocksize; }
+	inline uint32_t block_size() const { return 1u << block_size_bits(); }
+	inline uint32_t block_size_bits() const { return BlockSizeBits != 0 ? BlockSizeBits : blocksize_bits; }
 	// inline uint32_t blocks_per_group() const { return super_block.data.blocks_per_group; }
 
 	template <typename OStream> OStream &dump(OStream &os) const {
@@ -295,14 +514,30 @@ template <typename Device> struct filesystem {
       private:
 	uint64_t disk_start;
 	superblock<Device> super_block;
+	superblock_extension<Device> super_block_ext;
 	gd_table_type gd_table;
 	std::vector<bitmap<device_type> > block_bitmaps;
 	std::vector<bitmap<device_type> > inode_bitmaps;
-	uint32_t blocksize;
+	uint32_t blocksize_bits;
+	inode_cache_type inodes;
+	mutable dentry_cache dentries;
+
+	inode_type read_inode(uint32_t inodeid) {
+		auto block_group_id = (inodeid - 1) / super_block.data.inodes_per_group;
+		auto index = (inodeid - 1) % super_block.data.inodes_per_group;
+		auto block_id = (index * super_block.data.inode_size) >> block_size_bits();
+		auto block_offset = (index * super_block.data.inode_size) & (block_size() - 1);
+		block_id += gd_table[block_group_id].data.address_inode_table;
+		inode_type result(this, inodeid, to_address(block_id, block_offset));
+		result.load();
+		return result;
+	}
 
 	std::pair<uint32_t, inode_type> create_inode(detail::inode_types type, uint64_t permissions = detail::inode_permissions_default, uint16_t uid = 0,
 						     uint16_t gid = 0, uint32_t flags = 0) {
 		auto inodeid = alloc_inode();
+		// a former directory with this id may still have cached entries
+		dentries.erase_directory(inodeid);
 		auto inode = get_inode(inodeid);
 		inode.data.type = type | permissions;
 		inode.data.uid = uid;
@@ -332,8 +567,9 @@ template <typename Device> struct filesystem {
 		inode.data.os_specific_2.linux.uid_high = 0;
 		inode.data.os_specific_2.linux.gid_high = 0;
 		inode.data.os_specific_2.linux.padding2 = 0;
+		inode.mark_dirty();
 
-		return std::make_pair(inodeid, inode);
+		return std::make_pair(inodeid, std::move(inode));
 	}
 };
 
@@ -343,6 +579,32 @@ template <typename Device> filesystem<Device> read_filesystem(Device &d, uint32_
 	return result;
 }
 
+/*
+ * read_filesystem<12>(d) returns a filesystem which is specialized for 4K blocks.
+ * throws error::block_size_error, if the block size of the filesystem differs.
+ */
+template <uint32_t BlockSizeBits, typename Device> filesystem<Device, BlockSizeBits> read_filesystem(Device &d, uint32_t partition_offset = 0) {
+	filesystem<Device, BlockSizeBits> result(d, partition_offset);
+	result.load();
+	return result;
+}
+
+/*
+ * calls f with the filesystem of the device, specialized for its block size. Other block sizes are handled at runtime.
+ */
+template <typename Device, typename F> auto with_filesystem(Device &d, F f, uint32_t partition_offset = 0) {
+	switch (read_superblock(d, partition_offset + 1024).data.block_size_log) {
+	case 0:
+		return f(read_filesystem<10>(d, partition_offset));
+	case 1:
+		return f(read_filesystem<11>(d, partition_offset));
+	case 2:
+		return f(read_filesystem<12>(d, partition_offset));
+	default:
+		return f(read_filesystem(d, partition_offset));
+	}
+}
+
 } /* namespace ext2 */
 
 #endif /* __FILESYSTEM_HPP__ */
@@ -0,0 +1,403 @@
+/*
+*
+*	Author: Philipp Zschoche, https://zschoche.org
+*
+*/
+#ifndef __HOST_IO_HPP__
+#define __HOST_IO_HPP__
+
+#include "filesystem.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+namespace ext2 {
+
+namespace detail {
+
+/*
+ * a buffer whose address and size are multiples of alignment, e.g. of the block size. Its content is not kept by reserve().
+ */
+class aligned_buffer {
+	char *p = nullptr;
+	uint64_t capacity = 0;
+	uint64_t alignment;
+
+      public:
+	aligned_buffer(uint64_t alignment) : alignment(alignment) {}
+	aligned_buffer(const aligned_buffer &) = delete;
+	aligned_buffer &operator=(const aligned_buffer &) = delete;
+	~aligned_buffer() { std::free(p); }
+
+	/* makes room for at least size bytes */
+	void reserve(uint64_t size) {
+		if (size <= capacity) {
+			return;
+		}
+		size = (size + alignment - 1) / alignment * alignment;
+		void *result = nullptr;
+		if (::posix_memalign(&result, alignment, size) != 0) {
+			throw std::bad_alloc();
+		}
+		std::free(p);
+		p = static_cast<char *>(result);
+		capacity = size;
+	}
+
+	inline char *data() { return p; }
+	inline uint64_t size() const { return capacity; }
+};
+
+/* writes the whole buffer to fd */
+inline void write_all(int fd, const char *buffer, uint64_t length) {
+	while (length > 0) {
+		auto result = ::write(fd, buffer, length);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			throw error::host_io_error();
+		}
+		buffer += result;
+		length -= result;
+	}
+}
+
+/*
+ * copies length bytes at offset of the image file to fd inside the kernel.
+ * returns false, if neither copy_file_range() nor sendfile() is possible for these files and nothing was copied.
+ */
+inline bool copy_in_kernel(int image_fd, uint64_t offset, int fd, uint64_t length) {
+#ifdef __linux__
+	off_t pos = offset;
+	bool use_copy_file_range = true;
+	while (length > 0) {
+		ssize_t result = -1;
+		if (use_copy_file_range) {
+			loff_t in = pos;
+			result = ::copy_file_range(image_fd, &in, fd, nullptr, length, 0);
+			if (result < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP)) {
+				// e.g. fd is a pipe or on another filesystem
+				use_copy_file_range = false;
+				continue;
+			}
+			if (result > 0) {
+				pos = in;
+			}
+		} else {
+			result = ::sendfile(fd, image_fd, &pos, length);
+			if (result < 0 && (errno == EINVAL || errno == ENOSYS) && pos == static_cast<off_t>(offset)) {
+				return false;
+			}
+		}
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			throw error::host_io_error();
+		}
+		if (result == 0) {
+			// the image is shorter than the filesystem
+			throw error::host_io_error();
+		}
+		length -= result;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* reads length bytes at offset of fd, returns false on a short file */
+inline bool read_all(int fd, uint64_t offset, char *buffer, uint64_t length) {
+	while (length > 0) {
+		auto result = ::pread(fd, buffer, length, offset);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			throw error::host_io_error();
+		}
+		if (result == 0) {
+			return false;
+		}
+		buffer += result;
+		offset += result;
+		length -= result;
+	}
+	return true;
+}
+
+/*
+ * copies length bytes at offset of fd to image_offset of the image file inside the kernel.
+ * returns false, if copy_file_range() is not possible for these files and nothing was copied.
+ */
+inline bool copy_in_kernel_to_image(int fd, uint64_t offset, int image_fd, uint64_t image_offset, uint64_t length) {
+#ifdef __linux__
+	loff_t in = offset;
+	loff_t out = image_offset;
+	while (length > 0) {
+		auto result = ::copy_file_range(fd, &in, image_fd, &out, length, 0);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			if (in == static_cast<loff_t>(offset) && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP)) {
+				return false;
+			}
+			throw error::host_io_error();
+		}
+		if (result == 0) {
+			// the source is shorter than expected
+			throw error::host_io_error();
+		}
+		length -= result;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+} /* namespace detail */
+
+/*
+ * writes the content of the inode to the host file descriptor fd and returns the number of written bytes.
+ * The data is copied extent by extent. If image_fd is the open image file of the device, the data blocks are copied by the kernel with
+ * copy_file_range() or sendfile(). Otherwise, or if the kernel can not do it for these files, they are read through the device
+ * into a block aligned buffer of buffer_size bytes. Holes are written as zeros.
+ */
+template <typename Inode> uint64_t copy_to_fd(const Inode &inode, int fd, int image_fd = -1, uint64_t buffer_size = 4 * 1024 * 1024) {
+	const uint64_t size = inode.size();
+	if (inode.is_symbolic_link() && size < 60) {
+		// fast symbolic link, the target is in the inode
+		std::string target(reinterpret_cast<const char *>(&inode.data.block_pointer_direct[0]), size);
+		detail::write_all(fd, target.c_str(), target.size());
+		return size;
+	}
+	const uint64_t block_size = inode.fs()->block_size();
+	detail::aligned_buffer buffer(block_size);
+	bool in_kernel = image_fd >= 0;
+	for (const auto &e : inode.map_extents(0, size)) {
+		uint64_t begin = e.logical * block_size;
+		const uint64_t end = std::min(size, (static_cast<uint64_t>(e.logical) + e.length) * block_size);
+		if (e.physical != 0 && in_kernel) {
+			if (detail::copy_in_kernel(image_fd, inode.fs()->to_address(e.physical, 0), fd, end - begin)) {
+				continue;
+			}
+			in_kernel = false;
+		}
+		while (begin < end) {
+			auto length = std::min(end - begin, buffer_size);
+			buffer.reserve(length);
+			if (e.physical == 0) {
+				std::fill(buffer.data(), buffer.data() + length, 0);
+			} else {
+				inode.fs()->device()->read(inode.fs()->to_address(e.physical, begin - (e.logical * block_size)), buffer.data(), length);
+			}
+			detail::write_all(fd, buffer.data(), length);
+			begin += length;
+		}
+	}
+	return size;
+}
+
+/*
+ * fills the allocated blocks of the inode with the first size() bytes of the host file descriptor fd.
+ * The data is copied extent by extent, like copy_to_fd(), either by the kernel into image_fd or through a buffer of buffer_size bytes.
+ */
+template <typename Inode> void copy_from_fd(Inode &inode, int fd, int image_fd = -1, uint64_t buffer_size = 4 * 1024 * 1024) {
+	const uint64_t size = inode.size();
+	const uint64_t block_size = inode.fs()->block_size();
+	detail::aligned_buffer buffer(block_size);
+	bool in_kernel = image_fd >= 0;
+	for (const auto &e : inode.map_extents(0, size)) {
+		uint64_t begin = e.logical * block_size;
+		const uint64_t end = std::min(size, (static_cast<uint64_t>(e.logical) + e.length) * block_size);
+		if (e.physical != 0 && in_kernel) {
+			if (detail::copy_in_kernel_to_image(fd, begin, image_fd, inode.fs()->to_address(e.physical, 0), end - begin)) {
+				continue;
+			}
+			in_kernel = false;
+		}
+		while (begin < end) {
+			auto length = std::min(end - begin, buffer_size);
+			buffer.reserve(length);
+			if (!detail::read_all(fd, begin, buffer.data(), length)) {
+				throw error::host_io_error();
+			}
+			if (e.physical == 0) {
+				// allocates the missing blocks
+				inode.write(begin, buffer.data(), length);
+			} else {
+				inode.fs()->device()->write(inode.fs()->to_address(e.physical, begin - (e.logical * block_size)), buffer.data(), length);
+			}
+			begin += length;
+		}
+	}
+}
+
+namespace detail {
+
+/*
+ * frees the blocks and the inode of a file, which was created for an import that failed before it was linked.
+ * Errors are ignored, the caller reports the error of the import.
+ */
+template <typename Filesystem, typename Inode> void discard_file(Filesystem *fs, uint32_t id, Inode &inode) {
+	try {
+		inode.data.count_hard_link = 0;
+		inode.mark_dirty();
+		inode.set_size(0);
+		fs->free_inode(id);
+	} catch (...) {
+	}
+}
+
+} /* namespace detail */
+
+/*
+ * creates the regular file name in dir with the content of the host file host_path and returns its inode id.
+ * All blocks are allocated at once before the data is copied with copy_from_fd(). The directory entry is added at the end.
+ * If the allocation or the copy fails, the blocks and the inode are freed again before the error is rethrown.
+ * If batch is set, the entry is appended to it instead, to add many entries at once with directory::insert_batch().
+ */
+template <typename Directory>
+uint32_t import_file(Directory &dir, const std::string &name, const std::string &host_path, int image_fd = -1, directory_entry_list *batch = nullptr) {
+	int fd = ::open(host_path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw error::host_io_error();
+	}
+	try {
+		struct stat st;
+		if (::fstat(fd, &st) != 0) {
+			throw error::host_io_error();
+		}
+		auto id_file = dir.fs()->create_file();
+		try {
+			id_file.second.set_size(st.st_size);
+			copy_from_fd(id_file.second, fd, image_fd);
+		} catch (...) {
+			detail::discard_file(dir.fs(), id_file.first, id_file.second);
+			throw;
+		}
+		auto entry = create_directory_entry(name, id_file.first, id_file.second);
+		id_file.second.flush();
+		if (batch != nullptr) {
+			batch->push_back(std::move(entry));
+		} else {
+			dir << entry;
+		}
+		::close(fd);
+		return id_file.first;
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+}
+
+/*
+ * the data part of an import. It only uses the host file and the image file, so jobs can run on other threads while the
+ * filesystem is used.
+ */
+struct import_job {
+	std::string host_path;
+	uint32_t inode_id;
+	std::vector<std::pair<uint64_t, uint64_t> > runs; // (image offset, length) in file order
+	uint32_t parent;				  // the directory of the entry
+	std::string name;
+};
+
+/*
+ * like import_file(), but the data is not copied. run_import() copies it later into image_fd.
+ */
+template <typename Directory>
+import_job prepare_import(Directory &dir, const std::string &name, const std::string &host_path, directory_entry_list *batch = nullptr) {
+	struct stat st;
+	if (::stat(host_path.c_str(), &st) != 0) {
+		throw error::host_io_error();
+	}
+	auto id_file = dir.fs()->create_file();
+	try {
+		id_file.second.set_size(st.st_size);
+	} catch (...) {
+		detail::discard_file(dir.fs(), id_file.first, id_file.second);
+		throw;
+	}
+	import_job result{host_path, id_file.first, {}, dir.id(), name};
+	const uint64_t block_size = dir.fs()->block_size();
+	uint64_t offset = 0;
+	for (const auto &e : id_file.second.map_extents(0, st.st_size)) {
+		auto length = std::min<uint64_t>(st.st_size - offset, e.length * block_size);
+		result.runs.emplace_back(dir.fs()->to_address(e.physical, 0), length);
+		offset += length;
+	}
+	auto entry = create_directory_entry(name, id_file.first, id_file.second);
+	id_file.second.flush();
+	if (batch != nullptr) {
+		batch->push_back(std::move(entry));
+	} else {
+		dir << entry;
+	}
+	return result;
+}
+
+/*
+ * undoes a prepared import, whose data could not be copied by run_import(). The entry is removed, the blocks and the inode are freed.
+ * The file was linked with its full size, so it would show whatever the blocks held before.
+ */
+template <typename Filesystem> void discard_import(Filesystem &fs, const import_job &job) {
+	auto parent = fs.get_inode(job.parent);
+	if (auto *dir = to_directory(&parent)) {
+		if (dir->lookup(job.name) == job.inode_id) {
+			dir->remove(job.name);
+		}
+	}
+}
+
+/*
+ * copies the data of a prepared import into the image file. This is thread-safe.
+ */
+inline void run_import(const import_job &job, int image_fd, uint64_t buffer_size = 1024 * 1024) {
+	int fd = ::open(job.host_path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw error::host_io_error();
+	}
+	detail::aligned_buffer buffer(4096);
+	uint64_t offset = 0;
+	bool in_kernel = true;
+	try {
+		for (const auto &run : job.runs) {
+			if (in_kernel && detail::copy_in_kernel_to_image(fd, offset, image_fd, run.first, run.second)) {
+				offset += run.second;
+				continue;
+			}
+			in_kernel = false;
+			for (uint64_t done = 0; done < run.second;) {
+				auto length = std::min(run.second - done, buffer_size);
+				buffer.reserve(length);
+				if (!detail::read_all(fd, offset + done, buffer.data(), length)) {
+					throw error::host_io_error();
+				}
+				for (uint64_t written = 0; written < length;) {
+					auto result = ::pwrite(image_fd, buffer.data() + written, length - written, run.first + done + written);
+					if (result < 0 && errno != EINTR) {
+						throw error::host_io_error();
+					}
+					written += std::max<ssize_t>(result, 0);
+				}
+				done += length;
+			}
+			offset += run.second;
+		}
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+}
+
+} /* namespace ext2 */
+
+#endif /* __HOST_IO_HPP__ */
@@ -0,0 +1,260 @@
+/*
+*
+*	Author: Philipp Zschoche, https://zschoche.org
+*
+*/
+#ifndef __HTREE_HPP__
+#define __HTREE_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * hash tree indexed directories (dir_index), compatible with Linux.
+ * https://www.kernel.org/doc/html/latest/filesystems/ext4/directory.html#hash-tree-directories
+ *
+ * Block 0 of an indexed directory holds "." and ".." followed by the root of the tree, the rec_len of ".." covers the rest of the block.
+ * Interior nodes are blocks with a single unused entry over the whole block. Leaves are ordinary directory blocks, therefore an indexed
+ * directory is also a valid linear directory.
+ */
+namespace ext2 {
+namespace htree {
+
+enum hash_version : uint8_t { legacy = 0, half_md4 = 1, tea = 2, legacy_unsigned = 3, half_md4_unsigned = 4, tea_unsigned = 5 };
+
+/* the part of the root block behind "." and ".." */
+struct __attribute__((packed)) root_info {
+	uint32_t reserved_zero;
+	uint8_t hash_version;
+	uint8_t info_length; // always 8
+	uint8_t indirect_levels;
+	uint8_t unused_flags;
+};
+
+constexpr uint32_t root_info_offset = 24;
+constexpr uint32_t root_entries_offset = 32;
+constexpr uint32_t node_entries_offset = 8;
+/* levels below the root without the large_dir feature */
+constexpr uint8_t max_indirect_levels = 1;
+
+namespace detail {
+
+constexpr uint32_t rol(uint32_t x, uint32_t s) { return (x << s) | (x >> (32 - s)); }
+
+inline void tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+	for (auto n = 0; n < 16; n++) {
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+inline void half_md4_transform(uint32_t buf[4], const uint32_t in[8]) {
+	auto f = [](uint32_t x, uint32_t y, uint32_t z) { return z ^ (x & (y ^ z)); };
+	auto g = [](uint32_t x, uint32_t y, uint32_t z) { return (x & y) + ((x ^ y) & z); };
+	auto h = [](uint32_t x, uint32_t y, uint32_t z) { return x ^ y ^ z; };
+	const uint32_t k2 = 013240474631u;
+	const uint32_t k3 = 015666365641u;
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	a = rol(a + f(b, c, d) + in[0], 3);
+	d = rol(d + f(a, b, c) + in[1], 7);
+	c = rol(c + f(d, a, b) + in[2], 11);
+	b = rol(b + f(c, d, a) + in[3], 19);
+	a = rol(a + f(b, c, d) + in[4], 3);
+	d = rol(d + f(a, b, c) + in[5], 7);
+	c = rol(c + f(d, a, b) + in[6], 11);
+	b = rol(b + f(c, d, a) + in[7], 19);
+
+	a = rol(a + g(b, c, d) + in[1] + k2, 3);
+	d = rol(d + g(a, b, c) + in[3] + k2, 5);
+	c = rol(c + g(d, a, b) + in[5] + k2, 9);
+	b = rol(b + g(c, d, a) + in[7] + k2, 13);
+	a = rol(a + g(b, c, d) + in[0] + k2, 3);
+	d = rol(d + g(a, b, c) + in[2] + k2, 5);
+	c = rol(c + g(d, a, b) + in[4] + k2, 9);
+	b = rol(b + g(c, d, a) + in[6] + k2, 13);
+
+	a = rol(a + h(b, c, d) + in[3] + k3, 3);
+	d = rol(d + h(a, b, c) + in[7] + k3, 9);
+	c = rol(c + h(d, a, b) + in[2] + k3, 11);
+	b = rol(b + h(c, d, a) + in[6] + k3, 15);
+	a = rol(a + h(b, c, d) + in[1] + k3, 3);
+	d = rol(d + h(a, b, c) + in[5] + k3, 9);
+	c = rol(c + h(d, a, b) + in[0] + k3, 11);
+	b = rol(b + h(c, d, a) + in[4] + k3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+/* the chars of the name are sign extended like on x86, if Char is signed char */
+template <typename Char> uint32_t legacy_hash(const char *name, uint32_t length) {
+	uint32_t hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	for (auto i = 0u; i < length; i++) {
+		uint32_t hash = hash1 + (hash0 ^ static_cast<uint32_t>(static_cast<int>(static_cast<Char>(name[i])) * 7152373));
+		if (hash & 0x80000000) {
+			hash -= 0x7fffffff;
+		}
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
+
+/* packs up to num * 4 chars of the name into buf, the rest is padded with the length */
+template <typename Char> void to_hash_buffer(const char *name, uint32_t length, uint32_t *buf, int num) {
+	uint32_t pad = length | (length << 8);
+	pad |= pad << 16;
+	uint32_t val = pad;
+	if (length > static_cast<uint32_t>(num) * 4) {
+		length = num * 4;
+	}
+	for (auto i = 0u; i < length; i++) {
+		val = static_cast<uint32_t>(static_cast<int>(static_cast<Char>(name[i]))) + (val << 8);
+		if (i % 4 == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0) {
+		*buf++ = val;
+	}
+	while (--num >= 0) {
+		*buf++ = pad;
+	}
+}
+
+template <typename Char> uint32_t half_md4_hash(const char *name, int length, uint32_t buf[4]) {
+	uint32_t in[8];
+	while (length > 0) {
+		to_hash_buffer<Char>(name, length, in, 8);
+		half_md4_transform(buf, in);
+		length -= 32;
+		name += 32;
+	}
+	return buf[1];
+}
+
+template <typename Char> uint32_t tea_hash(const char *name, int length, uint32_t buf[4]) {
+	uint32_t in[4];
+	while (length > 0) {
+		to_hash_buffer<Char>(name, length, in, 4);
+		tea_transform(buf, in);
+		length -= 16;
+		name += 16;
+	}
+	return buf[0];
+}
+
+} /* namespace detail */
+
+/*
+ * the hash of a name, like ext4fs_dirhash(). The lowest bit is always 0, it marks hash collisions in the index.
+ * An all zero seed is replaced by the default seed.
+ */
+inline uint32_t hash(const char *name, uint32_t length, uint8_t version, const uint32_t seed[4]) {
+	uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	if (seed[0] != 0 || seed[1] != 0 || seed[2] != 0 || seed[3] != 0) {
+		std::memcpy(buf, seed, sizeof(buf));
+	}
+	uint32_t result = 0;
+	switch (version) {
+	case legacy:
+		result = detail::legacy_hash<signed char>(name, length);
+		break;
+	case legacy_unsigned:
+		result = detail::legacy_hash<unsigned char>(name, length);
+		break;
+	case half_md4:
+		result = detail::half_md4_hash<signed char>(name, length, buf);
+		break;
+	case half_md4_unsigned:
+		result = detail::half_md4_hash<unsigned char>(name, length, buf);
+		break;
+	case tea:
+		result = detail::tea_hash<signed char>(name, length, buf);
+		break;
+	case tea_unsigned:
+		result = detail::tea_hash<unsigned char>(name, length, buf);
+		break;
+	}
+	result &= ~1u;
+	if (result == (0x7fffffffu << 1)) {
+		// reserved for the end of a readdir()
+		result = (0x7fffffffu - 1) << 1;
+	}
+	return result;
+}
+
+/*
+ * view on the index entries of the root or of an interior node. Each entry is a pair of a hash and a logical block of the
+ * directory. The first entry has no hash, limit and count are stored in its place.
+ */
+class entries_view {
+	char *p;
+
+      public:
+	entries_view(char *p) : p(p) {}
+
+	inline uint16_t limit() const { return get<uint16_t>(0); }
+	inline uint16_t count() const { return get<uint16_t>(2); }
+	inline void set_limit(uint16_t value) { set<uint16_t>(0, value); }
+	inline void set_count(uint16_t value) { set<uint16_t>(2, value); }
+	inline uint32_t hash(uint16_t i) const { return i == 0 ? 0 : get<uint32_t>(i * 8); }
+	inline uint32_t block(uint16_t i) const { return get<uint32_t>(i * 8 + 4); }
+	inline void set_hash(uint16_t i, uint32_t value) {
+		if (i != 0) {
+			set<uint32_t>(i * 8, value);
+		}
+	}
+	inline void set_block(uint16_t i, uint32_t value) { set<uint32_t>(i * 8 + 4, value); }
+
+	/* the last entry, whose hash is less than or equal to the given hash */
+	uint16_t find(uint32_t target) const {
+		uint16_t first = 1, last = count();
+		while (first < last) {
+			uint16_t middle = first + (last - first) / 2;
+			if (hash(middle) > target) {
+				last = middle;
+			} else {
+				first = middle + 1;
+			}
+		}
+		return first - 1;
+	}
+
+	/* inserts an entry at position i, count must be less than limit */
+	void insert(uint16_t i, uint32_t hash_value, uint32_t block_value) {
+		std::memmove(p + (i + 1) * 8, p + i * 8, (count() - i) * 8);
+		set_hash(i, hash_value);
+		set_block(i, block_value);
+		set_count(count() + 1);
+	}
+
+      private:
+	template <typename T> T get(uint32_t offset) const {
+		T result;
+		std::memcpy(&result, p + offset, sizeof(T));
+		return result;
+	}
+	template <typename T> void set(uint32_t offset, T value) { std::memcpy(p + offset, &value, sizeof(T)); }
+};
+
+/* the number of index entries in the root or in an interior node */
+inline uint16_t root_limit(uint32_t block_size) { return (block_size - root_entries_offset) / 8; }
+inline uint16_t node_limit(uint32_t block_size) { return (block_size - node_entries_offset) / 8; }
+
+} /* namespace htree */
+} /* namespace ext2 */
+
+#endif /* __HTREE_HPP__ */
@@ -7,8 +7,13 @@
 #define __INODE_HPP__
 
 #include "device_io.hpp"
+#include "directory_iterator.hpp"
 #include "error.hpp"
+#include "htree.hpp"
 #include <array>
+#include <cstring>
+#include <limits>
+#include <map>
 #include <sstream>
 
 namespace ext2 {
@@ -26,13 +31,34 @@ template <typename Filesystem, typename T> class fs_data : public block_data<typ
 	inline fs_type *fs() { return _fs; }
 	inline const fs_type *fs() const { return _fs; }
 
-	uint32_t get_inode_block_id() const { return this->offset() / fs()->block_size(); }
+	uint32_t get_inode_block_id() const { return this->offset() >> fs()->block_size_bits(); }
 };
 
 namespace inodes {
 template <typename Filesystem> struct directory;
 }
 
+/*
+ * a run of contiguous blocks of an inode. physical is 0 for holes
+ */
+struct extent {
+	uint32_t logical;  // first block index in the inode
+	uint32_t physical; // first block id on the device
+	uint32_t length;   // number of blocks
+};
+typedef std::vector<extent> extent_list;
+
+namespace detail {
+/*
+ * a decoded block of block pointers
+ */
+struct indirect_block {
+	uint32_t id = 0;
+	std::vector<uint32_t> ids;
+	bool dirty = false; // ids differ from the device
+};
+} /* namespace detail */
+
 /*
  * implements the device concept
  */
@@ -44,69 +70,121 @@ template <typename Filesystem> class inode : public fs_data<Filesystem, detail::
 	typedef Filesystem fs_type;
 
       private:
-	uint32_t get_indirect_block(uint32_t block, uint32_t index, uint32_t ids_per_block, int count) const {
-		if(count > 0) {
-			//index = index / ids_per_block;
-			--count;
-			block = this->get_indirect_block(block, index / ids_per_block, ids_per_block, count);
-			index = index % ids_per_block;
-		} 
+	/* log2 of the block size */
+	inline uint32_t block_bits() const { return this->fs()->block_size_bits(); }
+	/* log2 of the number of block ids in an indirect block */
+	inline uint32_t id_bits() const { return block_bits() - 2; }
 
-		uint32_t result;
-		detail::read_from_device(*(this->fs()->device()), this->fs()->to_address(block, index * sizeof(uint32_t)), result);
-		return result;	
-	}
+	/*
+	 * returns the depth of the tree (0 = indirect, 1 = doubly-indirect, 2 = triply-indirect) of the given block index >= 12
+	 * and sets index to the position in that tree
+	 */
+	int get_indirect_tree(uint32_t block_index, uint32_t &index) const {
+		const uint32_t bits = id_bits();
+		const uint64_t idp1_cut = (1ull << bits) + 12;
+		const uint64_t idp2_cut = (1ull << (2 * bits)) + idp1_cut;
+		const uint64_t idp3_cut = (1ull << (3 * bits)) + idp2_cut;
 
-	uint32_t get_block_id(uint32_t block_index) const {
-		if (block_index < 12) {
-			// direct pointer
-			return this->data.block_pointer_direct[block_index];
+		if (block_index < idp1_cut) {
+			index = block_index - 12;
+			return 0;
+		} else if (block_index < idp2_cut) {
+			index = block_index - idp1_cut;
+			return 1;
+		} else if (block_index < idp3_cut) {
+			index = block_index - idp2_cut;
+			return 2;
 		} else {
+			throw error::out_of_range_error();
+		}
+	}
 
-			auto id_per_block = (this->fs()->block_size() / 4);
-			auto idp1_cut = id_per_block + 12;
-			auto idp2_cut = (id_per_block * id_per_block) + idp1_cut;
-			auto idp3_cut = (id_per_block * id_per_block * id_per_block) + idp2_cut;
-
-			uint32_t block = 0;
-			uint32_t index = 0;
-			int count = 0;
-			if(block_index < idp1_cut) {
-				block = this->data.block_pointer_indirect[0];
-				count = 0;
-				index = block_index - 12;
-			} else if( block_index < idp2_cut) {
-				block = this->data.block_pointer_indirect[1];
-				count = 1;
-				index = block_index - idp1_cut;
-			} else if(block_index < idp3_cut) {
-				block = this->data.block_pointer_indirect[2];
-				count = 2;
-				index = block_index - idp2_cut;
-			} else {
-				throw error::out_of_range_error();
-			}
-			return get_indirect_block(block, index, id_per_block, count);
+	/*
+	 * returns the decoded indirect block. Each level of each tree has its own slot,
+	 * so a sequential access reads every indirect block only once.
+	 */
+	const std::vector<uint32_t> &get_indirect_block(uint32_t slot, uint32_t block) const {
+		auto &cached = indirect_blocks[slot];
+		if (cached.id != block) {
+			write_indirect_block(slot);
+			cached.ids.resize(this->fs()->block_size() / sizeof(uint32_t));
+			this->fs()->device()->read(this->fs()->to_address(block, 0), reinterpret_cast<char *>(cached.ids.data()), this->fs()->block_size());
+			cached.id = block;
 		}
+		return cached.ids;
 	}
 
-	uint32_t get_or_create_indirect_block(uint32_t block, uint32_t index, uint32_t ids_per_block, int count) {
-		if(count > 0) {
-			//index = index / ids_per_block;
-			--count;
-			block = this->get_or_create_indirect_block(block, index / ids_per_block, ids_per_block, count);
-			index = index % ids_per_block;
+	/*
+	 * puts an empty indirect block into the slot. It is written together with its entries.
+	 */
+	std::vector<uint32_t> &new_indirect_block(uint32_t slot, uint32_t block) {
+		auto &cached = indirect_blocks[slot];
+		write_indirect_block(slot);
+		cached.ids.assign(this->fs()->block_size() / sizeof(uint32_t), 0);
+		cached.id = block;
+		cached.dirty = true;
+		return cached.ids;
+	}
 
-			uint32_t result;
-			detail::read_from_device(*(this->fs()->device()), this->fs()->to_address(block, index * sizeof(uint32_t)), result);
-			if(result == 0) {
-				//we need a new block
-				result = this->fs()->alloc_block(this->get_inode_block_id());
-				detail::zeroing_device(*(this->fs()->device()), this->fs()->to_address(result, 0), this->fs()->block_size());
-				detail::write_to_device(*(this->fs()->device()), this->fs()->to_address(block, index * sizeof(uint32_t)), result);
-			}
-			block = result;
-		} 
+	/*
+	 * changes an entry of an indirect block in memory. The block is written when it leaves the slot or by flush()
+	 */
+	void set_indirect_entry(uint32_t slot, uint32_t block, uint32_t index, uint32_t value) {
+		get_indirect_block(slot, block);
+		indirect_blocks[slot].ids[index] = value;
+		indirect_blocks[slot].dirty = true;
+	}
+
+	/* writes the indirect block of the slot back, if it was changed */
+	void write_indirect_block(uint32_t slot) const {
+		auto &cached = indirect_blocks[slot];
+		if (cached.dirty) {
+			auto *fs = const_cast<inode *>(this)->fs();
+			fs->device()->write(fs->to_address(cached.id, 0), reinterpret_cast<const char *>(cached.ids.data()), fs->block_size());
+			cached.dirty = false;
+		}
+	}
+
+	void write_indirect_blocks() const {
+		for (auto slot = 0u; slot < indirect_blocks.size(); slot++) {
+			write_indirect_block(slot);
+		}
+	}
+
+	uint32_t alloc_indirect_block(uint32_t slot) {
+		auto block = this->fs()->alloc_block(this->get_inode_block_id());
+		new_indirect_block(slot, block);
+		this->data.count_sector += this->fs()->block_size() / 512;
+		return block;
+	}
+
+	/* writes back and drops all cached indirect blocks */
+	void invalidate_indirect_blocks() const {
+		write_indirect_blocks();
+		for (auto &cached : indirect_blocks) {
+			cached.id = 0;
+		}
+	}
+
+	/*
+	 * returns 0, if the block is not allocated
+	 */
+	uint32_t get_block_id(uint32_t block_index) const {
+		if (block_index < 12) {
+			// direct pointer
+			return this->data.block_pointer_direct[block_index];
+		}
+		const uint32_t bits = id_bits();
+		const uint32_t mask = (1u << bits) - 1;
+		uint32_t index = 0;
+		int count = get_indirect_tree(block_index, index);
+		uint32_t block = this->data.block_pointer_indirect[count];
+		uint32_t slot = first_slot[count];
+		for (uint32_t shift = count * bits; block != 0; shift -= bits) {
+			block = get_indirect_block(slot++, block)[(index >> shift) & mask];
+			if (shift == 0)
+				break;
+		}
 		return block;
 	}
 
@@ -114,117 +192,409 @@ template <typename Filesystem> class inode : public fs_data<Filesystem, detail::
 		if (block_index < 12) {
 			// direct pointer
 			this->data.block_pointer_direct[block_index] = new_block_id;
-			this->save();
-		} else {
+			this->mark_dirty();
+			return;
+		}
+		const uint32_t bits = id_bits();
+		const uint32_t mask = (1u << bits) - 1;
+		uint32_t index = 0;
+		int count = get_indirect_tree(block_index, index);
+		uint32_t block = this->data.block_pointer_indirect[count];
+		uint32_t slot = first_slot[count];
+		if (block == 0) {
+			if (new_block_id == 0)
+				return;
+			block = alloc_indirect_block(slot);
+			this->data.block_pointer_indirect[count] = block;
+			this->mark_dirty();
+		}
+		for (uint32_t shift = count * bits; shift > 0; shift -= bits) {
+			auto i = (index >> shift) & mask;
+			auto next = get_indirect_block(slot, block)[i];
+			if (next == 0) {
+				if (new_block_id == 0)
+					return;
+				// we need a new block
+				next = alloc_indirect_block(slot + 1);
+				set_indirect_entry(slot, block, i, next);
+			}
+			block = next;
+			slot++;
+		}
+		set_indirect_entry(slot, block, index & mask, new_block_id);
+	}
 
-			auto id_per_block = (this->fs()->block_size() / 4);
-			auto idp1_cut = id_per_block + 12;
-			auto idp2_cut = (id_per_block * id_per_block) + idp1_cut;
-			auto idp3_cut = (id_per_block * id_per_block * id_per_block) + idp2_cut;
-
-			uint32_t block = 0;
-			uint32_t index = 0;
-			int count = 0;
-			if(block_index < idp1_cut) {
-				if(this->data.block_pointer_indirect[0] == 0) {
-					block = this->fs()->alloc_block(this->get_inode_block_id());
-					detail::zeroing_device(*(this->fs()->device()), this->fs()->to_address(block, 0), this->fs()->block_size());
-					this->data.block_pointer_indirect[0] = block;
-					this->save();
-				} else {
-					block = this->data.block_pointer_indirect[0];
-				}
-				count = 0;
-				index = block_index - 12;
-
-			} else if( block_index < idp2_cut) {
-				if(this->data.block_pointer_indirect[1] == 0) {
-					block = this->fs()->alloc_block(this->get_inode_block_id());
-					detail::zeroing_device(*(this->fs()->device()), this->fs()->to_address(block, 0), this->fs()->block_size());
-					this->data.block_pointer_indirect[1] = block;
-					this->save();
-				} else {
-					block = this->data.block_pointer_indirect[1];
-				}
-				count = 1;
-				index = block_index - idp1_cut;
-
-			} else if(block_index < idp3_cut) {
-				if(this->data.block_pointer_indirect[2] == 0) {
-					block = this->fs()->alloc_block(this->get_inode_block_id());
-					detail::zeroing_device(*(this->fs()->device()), this->fs()->to_address(block, 0), this->fs()->block_size());
-					this->data.block_pointer_indirect[2] = block;
-					this->save();
-				} else {
-					block = this->data.block_pointer_indirect[2];
-				}
-				count = 2;
-				index = block_index - idp2_cut;
+	static void append_extent(extent_list &extents, uint32_t logical, uint32_t physical, uint32_t length) {
+		if (!extents.empty()) {
+			auto &last = extents.back();
+			if (last.logical + last.length == logical && ((last.physical == 0 && physical == 0) || (last.physical != 0 && last.physical + last.length == physical))) {
+				last.length += length;
+				return;
+			}
+		}
+		extents.push_back(extent{logical, physical, length});
+	}
 
+	/*
+	 * appends the mapping of the entries [first, last) of a (sub)tree. span is the number of data blocks below each entry of block.
+	 */
+	void map_indirect(uint32_t block, uint32_t slot, uint64_t span, uint64_t first, uint64_t last, uint64_t logical, extent_list &extents) const {
+		if (block == 0) {
+			append_extent(extents, logical + first, 0, last - first);
+			return;
+		}
+		const auto &ids = get_indirect_block(slot, block);
+		for (auto i = first / span; i * span < last; i++) {
+			if (span == 1) {
+				append_extent(extents, logical + i, ids[i], 1);
 			} else {
-				throw error::out_of_range_error();
+				auto lo = std::max(first, i * span);
+				auto hi = std::min(last, (i + 1) * span);
+				map_indirect(ids[i], slot + 1, (span >> id_bits()), lo - (i * span), hi - (i * span), logical + (i * span), extents);
 			}
+		}
+	}
+
+	inline uint64_t blocks_for(uint64_t size) const { return (size + this->fs()->block_size() - 1) >> block_bits(); }
 
-			if(count > 0) {
-				//index = index / id_per_block;
-				//--count;
-				block = this->get_or_create_indirect_block(block, index / id_per_block, id_per_block, count);
-				index = index % id_per_block;
+	/*
+	 * returns the number of indirect blocks which are needed for the blocks [first, last), if the trees are empty
+	 */
+	uint64_t count_indirect_blocks(uint64_t first, uint64_t last) const {
+		const uint64_t id_per_block = 1ull << id_bits();
+		uint64_t result = 0;
+		uint64_t base = 12;
+		uint64_t span = id_per_block;
+		for (auto depth = 0u; depth < 3 && base < last; depth++) {
+			auto end = base + span;
+			auto lo = std::max(first, base);
+			auto hi = std::min(last, end);
+			for (auto cover = span; lo < hi && cover >= id_per_block; cover /= id_per_block) {
+				result += ((hi - 1 - base) / cover) - ((lo - base) / cover) + 1;
 			}
-			detail::write_to_device(*(this->fs()->device()), this->fs()->to_address(block, index * sizeof(uint32_t)), new_block_id);	
+			base = end;
+			span *= id_per_block;
 		}
+		return result;
 	}
 
-      public:
-	inline void set_size(uint64_t new_size) {
-		uint64_t old_size = this->size();
-		if (is_regular_file() && this->fs()->large_files()) {
-			this->data.size = new_size;
-			new_size >>= 32;
-			this->data.dir_acl = new_size;
+	/*
+	 * sets the unallocated entries [first, last) of a (sub)tree to the next allocated blocks. A new indirect block is taken from the
+	 * allocation before its entries. returns the id of the (new) block
+	 */
+	template <typename Allocation>
+	uint32_t fill_indirect(uint32_t block, uint32_t slot, uint64_t span, uint64_t first, uint64_t last, Allocation &next) {
+		auto &cached = indirect_blocks[slot];
+		if (block == 0) {
+			block = next();
+			new_indirect_block(slot, block);
 		} else {
-			if (std::numeric_limits<uint32_t>::max() < new_size) {
-				throw error::file_is_full_error();
+			get_indirect_block(slot, block);
+		}
+		for (auto i = first / span; i * span < last; i++) {
+			if (span == 1) {
+				if (cached.ids[i] == 0) {
+					cached.ids[i] = next();
+				}
+			} else {
+				auto lo = std::max(first, i * span);
+				auto hi = std::min(last, (i + 1) * span);
+				cached.ids[i] = fill_indirect(cached.ids[i], slot + 1, (span >> id_bits()), lo - (i * span), hi - (i * span), next);
 			}
-			this->data.size = new_size;
 		}
+		cached.dirty = true;
+		return block;
+	}
+
+	/*
+	 * allocates the blocks [first, last) with one allocation
+	 */
+	void extend(uint64_t first, uint64_t last) {
+		if (first >= last) {
+			return;
+		}
+		auto related = first > 0 ? get_block_id(first - 1) : 0;
+		if (related == 0) {
+			related = this->get_inode_block_id();
+		}
+		uint64_t count = (last - first) + count_indirect_blocks(first, last);
+		if (std::numeric_limits<uint32_t>::max() < count) {
+			throw error::file_is_full_error();
+		}
+		// alloc_blocks() returns all count blocks or throws, so next() never runs past the end
+		auto runs = this->fs()->alloc_blocks(count, related);
+		auto run = runs.begin();
+		uint32_t taken = 0;
+		auto next = [&]() -> uint32_t {
+			if (taken == run->length) {
+				++run;
+				taken = 0;
+			}
+			return run->physical + taken++;
+		};
+
+		for (auto i = first; i < std::min<uint64_t>(last, 12); i++) {
+			if (this->data.block_pointer_direct[i] == 0) {
+				this->data.block_pointer_direct[i] = next();
+			}
+		}
+		const uint64_t id_per_block = 1ull << id_bits();
+		uint64_t base = 12;
+		uint64_t span = 1;
+		for (auto depth = 0u; depth < 3 && base < last; depth++) {
+			auto end = base + (span * id_per_block);
+			auto lo = std::max(first, base);
+			auto hi = std::min(last, end);
+			if (lo < hi) {
+				this->data.block_pointer_indirect[depth] =
+				    fill_indirect(this->data.block_pointer_indirect[depth], first_slot[depth], span, lo - base, hi - base, next);
+			}
+			base = end;
+			span *= id_per_block;
+		}
+
+		// indirect blocks which already existed were counted too
+		uint32_t used = 0;
+		for (auto iter = runs.begin(); iter != run; ++iter) {
+			used += iter->length;
+		}
+		used += taken;
+		std::vector<uint32_t> unused;
+		for (; run != runs.end(); ++run, taken = 0) {
+			for (auto i = taken; i < run->length; i++) {
+				unused.push_back(run->physical + i);
+			}
+		}
+		this->fs()->free_blocks(std::move(unused));
 		/* http://www.nongnu.org/ext2-doc/ext2.html#I-BLOCKS */
-		this->data.count_sector = new_size / 512;
+		this->data.count_sector += used * (this->fs()->block_size() / 512);
+		this->mark_dirty();
+	}
 
-		if (new_size < old_size) {
-			// release unsued blocks
-			auto block_index = new_size / this->fs()->block_size();
-			block_index++;
-			uint32_t blockid = get_block_id(block_index);
-			while (blockid != 0) {
-				this->fs()->free_block(blockid);
-				set_block_id(block_index, 0);
-				block_index++;
-				blockid = get_block_id(block_index);
+	/*
+	 * clears the entries [first, end) of a (sub)tree and collects the released blocks. An indirect block which becomes empty
+	 * is released too. returns true, if block was released
+	 */
+	bool truncate_indirect(uint32_t block, uint32_t slot, uint64_t span, uint64_t first, std::vector<uint32_t> &released) {
+		auto &cached = indirect_blocks[slot];
+		get_indirect_block(slot, block);
+		bool changed = false;
+		for (auto i = first / span; i < cached.ids.size(); i++) {
+			if (cached.ids[i] == 0) {
+				continue;
 			}
-		} else if (new_size > old_size) {
-			// allocate new blocks
-			auto block_index_start = old_size / this->fs()->block_size();
-			auto block_index_end = new_size / this->fs()->block_size();
-			auto block_id = get_block_id(block_index_start);
-			if (block_id == 0) {
-				// the file is empty
-				block_id = this->fs()->alloc_block();
-				set_block_id(block_index_start, block_id);
+			if (span == 1) {
+				released.push_back(cached.ids[i]);
+				cached.ids[i] = 0;
+				changed = true;
+			} else if (truncate_indirect(cached.ids[i], slot + 1, (span >> id_bits()), std::max(first, i * span) - (i * span),
+						     released)) {
+				cached.ids[i] = 0;
+				changed = true;
+			}
+		}
+		if (first == 0) {
+			released.push_back(block);
+			cached.id = 0;
+			cached.dirty = false;
+			return true;
+		}
+		cached.dirty = cached.dirty || changed;
+		return false;
+	}
 
+	/*
+	 * releases all blocks from block index first on, including the indirect blocks which are no longer needed.
+	 * The blocks are freed with one call to the allocator.
+	 */
+	void truncate(uint64_t first) {
+		std::vector<uint32_t> released;
+		for (auto i = first; i < 12; i++) {
+			if (this->data.block_pointer_direct[i] != 0) {
+				released.push_back(this->data.block_pointer_direct[i]);
+				this->data.block_pointer_direct[i] = 0;
+			}
+		}
+		const uint64_t id_per_block = 1ull << id_bits();
+		uint64_t base = 12;
+		uint64_t span = 1;
+		for (auto depth = 0u; depth < 3; depth++) {
+			auto end = base + (span * id_per_block);
+			uint32_t root = this->data.block_pointer_indirect[depth];
+			if (first < end && root != 0 && truncate_indirect(root, first_slot[depth], span, first > base ? first - base : 0, released)) {
+				this->data.block_pointer_indirect[depth] = 0;
+			}
+			base = end;
+			span *= id_per_block;
+		}
+		if (!released.empty()) {
+			release_sectors(released.size());
+			this->fs()->free_blocks(std::move(released));
+			this->mark_dirty();
+		}
+	}
+
+	/*
+	 * appends all allocated blocks of a (sub)tree including the indirect blocks
+	 */
+	void collect_indirect(uint32_t block, uint32_t slot, uint32_t depth, std::vector<uint32_t> &blocks) const {
+		blocks.push_back(block);
+		for (auto id : get_indirect_block(slot, block)) {
+			if (id == 0) {
+				continue;
 			}
+			if (depth == 0) {
+				blocks.push_back(id);
+			} else {
+				collect_indirect(id, slot + 1, depth - 1, blocks);
+			}
+		}
+	}
 
-			
-			while (block_index_start < block_index_end) {
-				block_id = this->fs()->alloc_block(block_id);
-				++block_index_start;
-				set_block_id(block_index_start, block_id);
+	/*
+	 * returns all allocated data and indirect blocks with one traversal of the pointer tree
+	 */
+	std::vector<uint32_t> allocated_blocks() const {
+		std::vector<uint32_t> result;
+		for (auto i = 0u; i < 12; i++) {
+			if (this->data.block_pointer_direct[i] != 0) {
+				result.push_back(this->data.block_pointer_direct[i]);
+			}
+		}
+		for (auto depth = 0u; depth < 3; depth++) {
+			if (this->data.block_pointer_indirect[depth] != 0) {
+				collect_indirect(this->data.block_pointer_indirect[depth], first_slot[depth], depth, result);
 			}
 		}
-		this->save();
+		return result;
+	}
+
+	/* slots of the indirect block cache: one for the indirect tree, two for the doubly- and three for the triply-indirect tree */
+	static constexpr uint32_t first_slot[3] = {0, 1, 3};
+	mutable std::array<detail::indirect_block, 6> indirect_blocks;
+
+	uint32_t _id;
+	bool dirty = false;
+
+	/*
+	 * changes the size but does not write the inode
+	 */
+	void resize(uint64_t new_size) {
+		uint64_t old_size = this->size();
+		const bool large_file = is_regular_file() && this->fs()->large_files();
+		if (!large_file && std::numeric_limits<uint32_t>::max() < new_size) {
+			throw error::file_is_full_error();
+		}
+
+		if (new_size < old_size) {
+			truncate(blocks_for(new_size));
+		} else if (new_size > old_size) {
+			extend(blocks_for(old_size), blocks_for(new_size));
+		}
+
+		this->data.size = new_size;
+		if (large_file) {
+			this->data.dir_acl = new_size >> 32;
+		}
+		this->mark_dirty();
+	}
+
+	/* http://www.nongnu.org/ext2-doc/ext2.html#I-BLOCKS */
+	void release_sectors(uint32_t blocks) {
+		uint32_t sectors = blocks * (this->fs()->block_size() / 512);
+		this->data.count_sector = this->data.count_sector > sectors ? this->data.count_sector - sectors : 0;
+	}
+
+      public:
+	inline void set_size(uint64_t new_size) {
+		resize(new_size);
+		flush();
+	}
+
+	inode(fs_type *fs, uint32_t id, uint64_t offset) : fs_data<Filesystem, detail::inode>(fs, offset), _id(id) {}
+	/* unsaved changes belong to the original, a copy starts clean */
+	inode(const inode &other) : fs_data<Filesystem, detail::inode>(other), _id(other._id) {}
+	inode(inode &&other)
+	    : fs_data<Filesystem, detail::inode>(std::move(other)), indirect_blocks(std::move(other.indirect_blocks)), _id(other._id), dirty(other.dirty) {
+		other.dirty = false;
+		for (auto &cached : other.indirect_blocks) {
+			cached.id = 0;
+			cached.dirty = false;
+		}
+	}
+	/* writes back unsaved changes. A destructor must not throw, errors are only reported by an explicit flush() or fs.sync() */
+	~inode() {
+		try {
+			flush();
+		} catch (...) {
+		}
+	}
+
+	inline uint32_t id() const { return _id; }
+
+	/*
+	 * the inode will be written by the next flush()
+	 */
+	inline void mark_dirty() { dirty = true; }
+	inline bool is_dirty() const { return dirty; }
+	void flush() {
+		write_indirect_blocks();
+		if (dirty)
+			save();
+	}
+
+	/*
+	 * forgets the cached indirect blocks without writing them. Another copy of the inode was saved, so they may be freed and reused.
+	 */
+	void drop_indirect_blocks() const {
+		for (auto &cached : indirect_blocks) {
+			cached.id = 0;
+			cached.dirty = false;
+		}
 	}
 
-	inode(fs_type *fs, uint64_t offset) : fs_data<Filesystem, detail::inode>(fs, offset) {}
+	void save() {
+		fs_data<Filesystem, detail::inode>::save();
+		dirty = false;
+		this->fs()->update_cached_inode(*this);
+	}
+	void load() {
+		fs_data<Filesystem, detail::inode>::load();
+		invalidate_indirect_blocks();
+		dirty = false;
+		this->fs()->update_cached_inode(*this);
+	}
+
+	/*
+	 * returns the contiguous runs of blocks which hold the bytes [offset, offset + length) of this inode.
+	 * Every indirect block is read at most once.
+	 */
+	extent_list map_extents(uint64_t offset, uint64_t length) const {
+		extent_list result;
+		if (offset >= size() || length == 0 || (is_symbolic_link() && size() < 60)) {
+			return result;
+		}
+		length = std::min(length, size() - offset);
+		const uint64_t id_per_block = 1ull << id_bits();
+		const uint64_t first = offset >> block_bits();
+		const uint64_t last = ((offset + length - 1) >> block_bits()) + 1;
+		for (auto i = first; i < std::min<uint64_t>(last, 12); i++) {
+			append_extent(result, i, this->data.block_pointer_direct[i], 1);
+		}
+		uint64_t base = 12;
+		uint64_t span = 1;
+		for (auto depth = 0u; depth < 3 && base < last; depth++) {
+			auto end = base + (span * id_per_block);
+			auto lo = std::max(first, base);
+			auto hi = std::min(last, end);
+			if (lo < hi) {
+				map_indirect(this->data.block_pointer_indirect[depth], first_slot[depth], span, lo - base, hi - base, base, result);
+			}
+			base = end;
+			span *= id_per_block;
+		}
+		return result;
+	}
 
 	inline bool is_directory() const { return detail::has_flag(this->data.type, detail::directory); }
 	inline bool is_regular_file() const { return detail::has_flag(this->data.type, detail::regular_file); }
@@ -237,17 +607,30 @@ template <typename Filesystem> class inode : public fs_data<Filesystem, detail::
 		}
 	}
 
+	/*
+	 * issues one device read per contiguous run of blocks. Holes are filled with zeros. The target of a fast symbolic link is read from
+	 * the inode. Throws out_of_range_error, if the bytes reach behind size().
+	 */
 	void read(uint64_t offset, char *buffer, uint64_t length) const {
-		auto buffer_offset = 0;
-		do {
-			auto block_index = offset / this->fs()->block_size();
-			auto block_offset = offset % this->fs()->block_size();
-			auto block_length = std::min(this->fs()->block_size() - block_offset, length);
-			this->fs()->device()->read(this->fs()->to_address(get_block_id(block_index), block_offset), &buffer[buffer_offset], block_length);
-			buffer_offset += block_length;
-			offset += block_length;
-			length -= block_length;
-		} while (length > 0);
+		if (offset > size() || length > size() - offset) {
+			throw error::out_of_range_error();
+		}
+		if (is_symbolic_link() && size() < 60) {
+			std::memcpy(buffer, reinterpret_cast<const char *>(&this->data.block_pointer_direct[0]) + offset, length);
+			return;
+		}
+		const uint32_t bits = block_bits();
+		for (const auto &e : map_extents(offset, length)) {
+			const uint64_t first = static_cast<uint64_t>(e.logical) << bits;
+			auto begin = std::max(offset, first);
+			auto end = std::min(offset + length, first + (static_cast<uint64_t>(e.length) << bits));
+			if (e.physical == 0) {
+				std::memset(&buffer[begin - offset], 0, end - begin);
+			} else {
+				auto address = this->fs()->to_address(e.physical, 0) + (begin - first);
+				this->fs()->device()->read(address, &buffer[begin - offset], end - begin);
+			}
+		}
 	}
 	void write(uint64_t offset, const char *buffer, uint64_t length) {
 		auto buffer_offset = 0;
@@ -255,35 +638,220 @@ template <typename Filesystem> class inode : public fs_data<Filesystem, detail::
 			throw error::out_of_range_error();
 
 		if (offset + length > this->size()) {
-			set_size(offset + length);
+			resize(offset + length);
 		}
 		do {
-			auto block_index = offset / this->fs()->block_size();
-			auto block_offset = offset % this->fs()->block_size();
+			auto block_index = offset >> block_bits();
+			auto block_offset = offset & (this->fs()->block_size() - 1);
 			auto block_length = std::min(this->fs()->block_size() - block_offset, length);
 			auto block_id = get_block_id(block_index);
+			if (block_id == 0) {
+				// fill the hole
+				auto related = block_index > 0 ? get_block_id(block_index - 1) : 0;
+				block_id = this->fs()->alloc_block(related != 0 ? related : this->get_inode_block_id());
+				if (block_length < this->fs()->block_size()) {
+					detail::zeroing_device(*(this->fs()->device()), this->fs()->to_address(block_id, 0), this->fs()->block_size());
+				}
+				set_block_id(block_index, block_id);
+				this->data.count_sector += this->fs()->block_size() / 512;
+				this->mark_dirty();
+			}
 			this->fs()->device()->write(this->fs()->to_address(block_id, block_offset), &buffer[buffer_offset], block_length);
 			buffer_offset += block_length;
 			offset += block_length;
 			length -= block_length;
 		} while (length > 0);
+		flush();
 	}
 };
 
+template <typename Filesystem> constexpr uint32_t inode<Filesystem>::first_slot[3];
+
 template <typename OStream, typename Inode> void read_inode_content(OStream &os, Inode &inode) {
-	std::array<char, 255> buffer;
-	auto offset = 0u;
-	const auto size = inode.size();
-	do {
+	const uint64_t size = inode.size();
+	std::string buffer(std::min<uint64_t>(size, 1024 * 1024), '\0');
+	uint64_t offset = 0;
+	while (offset < size) {
 		auto length = std::min<uint64_t>(size - offset, buffer.size());
-		inode.read(offset, buffer.data(), length);
-		os << std::string(buffer.data(), length);
+		buffer.resize(length);
+		inode.read(offset, &buffer[0], length);
+		os << buffer;
 		offset += length;
-	} while (offset < size);
+	}
 }
 
 typedef std::vector<detail::directory_entry> directory_entry_list;
 
+namespace detail {
+
+/* the length of an entry with the given name length, entries are 4-byte aligned */
+inline uint16_t directory_entry_length(uint32_t name_size) { return (8 + name_size + 3) & ~3u; }
+
+inline void encode_directory_entry(char *buffer, const directory_entry &e) {
+	std::memcpy(buffer, &e.inode_id, 4);
+	std::memcpy(buffer + 4, &e.size, 2);
+	buffer[6] = e.name_size;
+	buffer[7] = e.type;
+	std::memcpy(buffer + 8, e.name.c_str(), e.name_size);
+}
+
+/*
+ * appends the used entries of one directory block. Entries never cross the end of a block,
+ * a corrupted entry ends the block.
+ */
+inline void parse_directory_block(const char *block, uint32_t length, directory_entry_list &entries) {
+	uint32_t offset = 0;
+	directory_entry_ref entry;
+	while (next_directory_entry(block, length, offset, entry)) {
+		entries.push_back(entry.to_entry());
+	}
+}
+
+/*
+ * returns the offset of the used entry name in one directory block or -1. previous is set to the offset of the entry before it
+ * or to -1, if it is the first one.
+ */
+inline int32_t find_in_directory_block(const char *block, uint32_t block_size, const std::string &name, int32_t *previous = nullptr) {
+	int32_t last = -1;
+	uint32_t offset = 0;
+	while (offset + 8 <= block_size) {
+		const char *current = block + offset;
+		uint32_t inode_id;
+		uint16_t size;
+		std::memcpy(&inode_id, current, 4);
+		std::memcpy(&size, current + 4, 2);
+		if (size < 8 || offset + size > block_size) {
+			break; // corrupted block
+		}
+		const uint8_t name_size = current[6];
+		if (inode_id != 0 && name_size == name.size() && std::memcmp(current + 8, name.c_str(), name_size) == 0) {
+			if (previous != nullptr) {
+				*previous = last;
+			}
+			return offset;
+		}
+		last = offset;
+		offset += size;
+	}
+	return -1;
+}
+
+/*
+ * adds the entry into the first free space of one directory block which is large enough: an unused entry or the spare rec_len
+ * behind an entry. returns false, if there is no such space.
+ */
+inline bool insert_into_directory_block(char *block, uint32_t block_size, directory_entry &e) {
+	const uint16_t needed = directory_entry_length(e.name_size);
+	uint32_t offset = 0;
+	while (offset + 8 <= block_size) {
+		char *current = block + offset;
+		uint32_t inode_id;
+		uint16_t size;
+		std::memcpy(&inode_id, current, 4);
+		std::memcpy(&size, current + 4, 2);
+		if (size < 8 || offset + size > block_size) {
+			break; // corrupted block
+		}
+		const uint16_t used = inode_id == 0 ? 0 : directory_entry_length(static_cast<uint8_t>(current[6]));
+		if (size - used >= needed) {
+			if (used > 0) {
+				// split the entry
+				std::memcpy(current + 4, &used, 2);
+			}
+			e.size = size - used;
+			encode_directory_entry(current + used, e);
+			return true;
+		}
+		offset += size;
+	}
+	return false;
+}
+
+/*
+ * extends the last entry of a directory block, which ends at length, to the end of the block. Directories of older versions may end
+ * inside a block, the rest of that block must belong to an entry before the directory grows.
+ */
+inline void pad_directory_block(char *block, uint32_t length, uint32_t block_size) {
+	int32_t last = -1;
+	uint32_t offset = 0;
+	while (offset < length && offset + 8 <= block_size) {
+		uint16_t size;
+		std::memcpy(&size, block + offset + 4, 2);
+		if (size < 8 || offset + size > block_size) {
+			break; // corrupted block
+		}
+		last = offset;
+		offset += size;
+	}
+	if (offset >= block_size) {
+		return;
+	}
+	if (last < 0) {
+		// an unused entry over the whole block
+		std::memset(block, 0, block_size);
+		last = 0;
+		offset = 0;
+	}
+	uint16_t size;
+	std::memcpy(&size, block + last + 4, 2);
+	size += block_size - offset;
+	std::memcpy(block + last + 4, &size, 2);
+}
+
+/*
+ * merges the rec_len of the entry name into the previous entry of the block or marks it unused, if it is the first one.
+ * returns false, if there is no such entry.
+ */
+inline bool remove_from_directory_block(char *block, uint32_t block_size, const std::string &name) {
+	int32_t previous;
+	auto offset = find_in_directory_block(block, block_size, name, &previous);
+	if (offset < 0) {
+		return false;
+	}
+	if (previous >= 0) {
+		uint16_t previous_size, size;
+		std::memcpy(&previous_size, block + previous + 4, 2);
+		std::memcpy(&size, block + offset + 4, 2);
+		previous_size += size;
+		std::memcpy(block + previous + 4, &previous_size, 2);
+	} else {
+		uint32_t inode_id = 0;
+		std::memcpy(block + offset, &inode_id, 4);
+	}
+	return true;
+}
+
+/*
+ * packs the entries into one directory block, the last entry takes the rest of it. A block without entries gets one unused entry.
+ * returns false, if the entries do not fit.
+ */
+inline bool encode_directory_block(char *block, uint32_t block_size, directory_entry_list &entries) {
+	uint32_t offset = 0;
+	for (auto &e : entries) {
+		e.name_size = e.name.size();
+		e.size = directory_entry_length(e.name_size);
+		offset += e.size;
+	}
+	if (offset > block_size) {
+		return false;
+	}
+	std::memset(block, 0, block_size);
+	if (entries.empty()) {
+		directory_entry unused{0, static_cast<uint16_t>(block_size), 0, directory_entry_type::unknown_type, ""};
+		encode_directory_entry(block, unused);
+		return true;
+	}
+	entries.back().size += block_size - offset;
+	offset = 0;
+	for (const auto &e : entries) {
+		encode_directory_entry(block + offset, e);
+		offset += e.size;
+	}
+	return true;
+}
+
+} /* namespace detail */
+
 namespace inodes {
 template <typename Filesystem> struct file : inode<Filesystem> {
 
@@ -334,53 +902,455 @@ template <typename Filesystem> struct symbolic_link : inode<Filesystem> {
 				this->set_size(target.size());
 			}
 		}
-		this->save();
+		this->mark_dirty();
+		this->flush();
 	}
 };
 
 
 template <typename Filesystem> struct directory : inode<Filesystem> {
 
+	/*
+	 * reads the whole directory at once and parses it block by block
+	 */
 	directory_entry_list read_entries() const {
-		auto offset = 0u;
 		directory_entry_list result;
 		result.reserve(8);
-		do {
-			detail::directory_entry entry;
-			detail::read_from_device(*this, offset, entry, 8);
-			if (entry.inode_id == 0)
-				break;
-			offset += 8;
-			entry.name.resize(entry.name_size);
-			this->read(offset, const_cast<char *>(entry.name.c_str()), entry.name_size);
-			offset += entry.size - 8;
-			result.push_back(std::move(entry));
-		} while (offset < this->size());
+		const uint32_t block_size = this->fs()->block_size();
+		std::vector<char> buffer(this->size());
+		this->read(0, buffer.data(), buffer.size());
+		for (uint64_t offset = 0; offset < buffer.size(); offset += block_size) {
+			detail::parse_directory_block(&buffer[offset], std::min<uint64_t>(block_size, buffer.size() - offset), result);
+		}
+		return result;
+	}
+
+	/*
+	 * the entries without reading the whole directory or copying the names, e.g. for (const auto &e : dir->entries()).
+	 * An iteration can be resumed later at the cookie() of an iterator, e.g. by readdir().
+	 */
+	directory_range<directory> entries(uint64_t cookie = 0) const { return directory_range<directory>(this, cookie); }
+
+	/* true, if the directory has no entries besides "." and ".." */
+	bool is_empty() const {
+		for (const auto &e : entries()) {
+			if (e.name != "." && e.name != "..") {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/*
+	 * replaces the content of the directory. The entries are packed into blocks, the last entry of each block takes the rest of it.
+	 * The directory keeps its blocks, the ones behind the entries are left empty.
+	 */
+	void write_entries(directory_entry_list &entries) { write_entries(entries, this->size()); }
+
+	/*
+	 * adds the entry into the first free space which is large enough: an unused entry or the spare rec_len behind an entry.
+	 * The blocks are read one by one up to the first one with space, only that block is written. A new block is added, if there is no space.
+	 * Indexed directories add the entry to the leaf of its hash and split the leaf, if it is full.
+	 */
+	void insert(detail::directory_entry e) {
+		const uint32_t block_size = this->fs()->block_size();
+		e.name_size = e.name.size();
+		this->fs()->dcache().erase(this->id(), e.name);
+		if (is_indexed() && insert_indexed(e)) {
+			return;
+		}
+		drop_index();
+		std::vector<char> block(block_size);
+		for (uint64_t offset = 0; offset < this->size(); offset += block_size) {
+			const auto length = std::min<uint64_t>(block_size, this->size() - offset);
+			this->read(offset, block.data(), length);
+			if (length < block_size) {
+				// a directory of an older version ends inside its last block, the block is completed
+				std::fill(block.begin() + length, block.end(), 0);
+				detail::pad_directory_block(block.data(), length, block_size);
+			}
+			const bool inserted = detail::insert_into_directory_block(block.data(), block_size, e);
+			if (inserted || length < block_size) {
+				this->write(offset, block.data(), block_size);
+			}
+			if (inserted) {
+				return;
+			}
+		}
+		// no space left, the new block starts at the next block boundary
+		std::fill(block.begin(), block.end(), 0);
+		e.size = block_size;
+		detail::encode_directory_entry(block.data(), e);
+		const auto offset = (this->size() + block_size - 1) / block_size * block_size;
+		this->set_size(offset + block_size);
+		this->write(offset, block.data(), block.size());
+	}
+
+	/* true, if the directory has a hash tree index. The index is used for lookups and kept up to date. */
+	bool is_indexed() const { return this->fs()->has_dir_index() && detail::has_flag(this->data.flags, detail::hash_dir); }
+
+	/*
+	 * returns the inode id of the entry name or 0, if there is no such entry. Results are kept in the dentry cache of the filesystem.
+	 * An indexed directory reads one block per level of its tree and the leaf, all others are scanned block by block.
+	 */
+	uint32_t lookup(const std::string &name) const {
+		uint32_t result = 0;
+		if (this->fs()->dcache().find(this->id(), name, result)) {
+			return result;
+		}
+		result = lookup_uncached(name);
+		this->fs()->dcache().insert(this->id(), name, result);
 		return result;
 	}
 
-	void write_entries(directory_entry_list &entries) {
+	/*
+	 * rewrites the directory with a hash tree index, like e2fsck -D. Later changes keep the index up to date.
+	 * returns false, if the filesystem has no dir_index feature or if there are too many entries for two levels of index blocks.
+	 */
+	bool build_index() {
+		if (!this->fs()->has_dir_index()) {
+			return false;
+		}
+		auto entries = read_entries();
+		return write_index(entries);
+	}
+
+	/*
+	 * packs the entries into as few blocks as possible and frees the blocks behind them, e.g. after many removals. An indexed directory
+	 * is indexed again with full leaves. Nothing is written, if the directory is already packed. returns the number of freed blocks,
+	 * including indirect blocks.
+	 */
+	uint64_t compact() {
+		const uint32_t block_size = this->fs()->block_size();
+		const uint64_t blocks = this->size() / block_size;
+		auto entries = read_entries();
+		uint64_t offset = 0;
+		for (const auto &e : entries) {
+			const auto length = detail::directory_entry_length(e.name.size());
+			const auto rest = block_size - (offset % block_size);
+			if (rest < length) {
+				offset += rest;
+			}
+			offset += length;
+		}
+		uint64_t packed = (offset + block_size - 1) / block_size;
+		if (is_indexed()) {
+			// the root block and the interior nodes
+			const uint64_t leaves = std::max<uint64_t>(packed, 1);
+			packed = 1 + leaves + (leaves <= htree::root_limit(block_size) ? 0 : (leaves + htree::node_limit(block_size) - 1) / htree::node_limit(block_size));
+		}
+		if (blocks <= packed) {
+			return 0;
+		}
+		// counts the indirect blocks, too
+		const uint64_t sectors = this->data.count_sector;
+		if (!is_indexed() || !write_index(entries)) {
+			write_entries(entries, 0);
+		}
+		return sectors > this->data.count_sector ? (sectors - this->data.count_sector) / (block_size / 512) : 0;
+	}
+
+	/*
+	 * adds all entries of [first, last) in one pass. Like insert(), a linear directory stays linear and an indexed one stays indexed.
+	 * A linear directory uses the free space of the existing blocks first, the rest is packed into new blocks, which are allocated at
+	 * once at the end of the directory. Every touched block is written once.
+	 * An indexed directory is rewritten with its index, if the batch is large compared to the directory. Otherwise the entries are
+	 * grouped by leaf and every leaf is read and written once. Entries which do not fit into their leaf split it like insert().
+	 */
+	template <typename Iterator> void insert_batch(Iterator first, Iterator last) {
+		const uint32_t block_size = this->fs()->block_size();
+		directory_entry_list batch(first, last);
+		if (batch.empty()) {
+			return;
+		}
+		for (auto &e : batch) {
+			e.name_size = e.name.size();
+			this->fs()->dcache().erase(this->id(), e.name);
+		}
+		if (is_indexed()) {
+			if (batch.size() * block_size >= this->size()) {
+				rewrite_with(batch);
+				return;
+			}
+			if (insert_into_leaves(batch)) {
+				return;
+			}
+			// the index can not be used, the directory continues as a linear one
+		}
+		drop_index();
+		const uint64_t size = this->size();
+		const uint64_t blocks = (size + block_size - 1) / block_size;
+		std::vector<char> buffer(blocks * block_size, 0);
+		this->read(0, buffer.data(), size);
+		std::vector<bool> touched(blocks, false);
+		if (size % block_size != 0) {
+			// a directory of an older version ends inside its last block, the block is completed
+			detail::pad_directory_block(&buffer[(blocks - 1) * block_size], size % block_size, block_size);
+			touched.back() = true;
+		}
+		auto pending = batch.begin();
+		for (uint64_t block = 0; block < blocks && pending != batch.end(); block++) {
+			while (pending != batch.end() && detail::insert_into_directory_block(&buffer[block * block_size], block_size, *pending)) {
+				touched[block] = true;
+				++pending;
+			}
+		}
+
+		// the rest goes into new blocks
+		std::vector<char> tail;
+		directory_entry_list list;
+		uint32_t used = 0;
+		auto add_block = [&]() {
+			tail.resize(tail.size() + block_size);
+			detail::encode_directory_block(&tail[tail.size() - block_size], block_size, list);
+			list.clear();
+			used = 0;
+		};
+		for (; pending != batch.end(); ++pending) {
+			const auto length = detail::directory_entry_length(pending->name_size);
+			if (used + length > block_size) {
+				add_block();
+			}
+			list.push_back(std::move(*pending));
+			used += length;
+		}
+		if (!list.empty()) {
+			add_block();
+		}
+
+		for (uint64_t block = 0; block < blocks;) {
+			if (!touched[block]) {
+				block++;
+				continue;
+			}
+			auto end = block;
+			while (end < blocks && touched[end]) {
+				end++;
+			}
+			this->write(block * block_size, &buffer[block * block_size], (end - block) * block_size);
+			block = end;
+		}
+		if (!tail.empty()) {
+			const auto offset = blocks * block_size;
+			this->set_size(offset + tail.size());
+			this->write(offset, tail.data(), tail.size());
+		}
+	}
+
+	/* adds all entries of the range */
+	template <typename Range> void insert_batch(const Range &entries) { insert_batch(std::begin(entries), std::end(entries)); }
+
+      private:
+	/* writes the entries like write_entries() and resizes the directory to size or to the blocks of the entries, if they need more */
+	void write_entries(directory_entry_list &entries, uint64_t size) {
+		const uint32_t block_size = this->fs()->block_size();
+		drop_index();
+		this->fs()->dcache().erase_directory(this->id());
+		std::vector<uint64_t> offsets;
+		offsets.reserve(entries.size());
 		uint64_t offset = 0;
 		for (auto i = 0u; i < entries.size(); i++) {
 			detail::directory_entry &e = entries[i];
 			e.name_size = e.name.size();
-			if (i + 1 == entries.size()) {
-				e.size = std::max<uint64_t>(8 + e.name_size, this->size() - offset);
-			} else {
-				e.size = 8 + e.name_size;
+			e.size = detail::directory_entry_length(e.name_size);
+			auto rest = block_size - (offset % block_size);
+			if (rest < e.size) {
+				// an entry never crosses the end of a block
+				entries[i - 1].size += rest;
+				offset += rest;
 			}
-			write_to_device(*this, offset, e, 8);
-			this->write(offset + 8, e.name.c_str(), e.name.size());
+			offsets.push_back(offset);
 			offset += e.size;
 		}
+		if (!entries.empty() && offset % block_size != 0) {
+			auto rest = block_size - (offset % block_size);
+			entries.back().size += rest;
+			offset += rest;
+		}
+		const uint64_t blocks = (std::max(offset, size) + block_size - 1) / block_size;
+		std::vector<char> buffer(blocks * block_size, 0);
+		for (auto i = 0u; i < entries.size(); i++) {
+			detail::encode_directory_entry(&buffer[offsets[i]], entries[i]);
+		}
+		for (auto empty = offset; empty < buffer.size(); empty += block_size) {
+			// an unused entry which takes the whole block
+			const uint16_t length = block_size;
+			std::memcpy(&buffer[empty + 4], &length, 2);
+		}
+		if (buffer.size() < this->size()) {
+			this->set_size(buffer.size());
+		}
+		if (!buffer.empty()) {
+			this->write(0, buffer.data(), buffer.size());
+		}
+	}
+
+	/* rewrites the indexed directory with its entries and the given ones, it becomes linear if they do not fit into the index */
+	void rewrite_with(const directory_entry_list &batch) {
+		auto entries = read_entries();
+		entries.insert(entries.end(), batch.begin(), batch.end());
+		if (!write_index(entries)) {
+			write_entries(entries);
+		}
 	}
 
+	/*
+	 * adds the entries to the leaves of their hashes, every leaf is read and written once. The entries which do not fit are added
+	 * by insert(). returns false without a change, if the index can not be used.
+	 */
+	bool insert_into_leaves(directory_entry_list &batch) {
+		const uint32_t block_size = this->fs()->block_size();
+		std::map<uint64_t, std::vector<detail::directory_entry *> > leaves;
+		index_path path;
+		for (auto &e : batch) {
+			if (!probe(e.name, path)) {
+				return false;
+			}
+			leaves[leaf_address(path)].push_back(&e);
+		}
+		std::vector<detail::directory_entry *> rest;
+		std::vector<char> leaf(block_size);
+		for (const auto &item : leaves) {
+			this->read(item.first, leaf.data(), block_size);
+			bool changed = false;
+			for (auto *e : item.second) {
+				if (detail::insert_into_directory_block(leaf.data(), block_size, *e)) {
+					changed = true;
+				} else {
+					rest.push_back(e);
+				}
+			}
+			if (changed) {
+				this->write(item.first, leaf.data(), block_size);
+			}
+		}
+		for (auto *e : rest) {
+			insert(*e);
+		}
+		return true;
+	}
+
+	/*
+	 * writes the entries with a hash tree index. returns false, if there are too many entries for two levels of index blocks.
+	 */
+	bool write_index(directory_entry_list &entries) {
+		const uint32_t block_size = this->fs()->block_size();
+		const uint8_t version = this->fs()->default_hash_version();
+		uint32_t dot = this->id(), dotdot = this->id();
+		std::vector<std::pair<uint32_t, detail::directory_entry *> > order;
+		order.reserve(entries.size());
+		for (auto &e : entries) {
+			if (e.name == ".") {
+				dot = e.inode_id;
+			} else if (e.name == "..") {
+				dotdot = e.inode_id;
+			} else {
+				order.emplace_back(this->fs()->dir_hash(e.name, version), &e);
+			}
+		}
+		std::stable_sort(order.begin(), order.end(), [](const auto &lhs, const auto &rhs) { return lhs.first < rhs.first; });
+
+		// fill the leaves in hash order
+		std::vector<uint32_t> leaf_begin{0};
+		uint32_t used = 0;
+		for (auto i = 0u; i < order.size(); i++) {
+			auto length = detail::directory_entry_length(order[i].second->name.size());
+			if (used + length > block_size) {
+				leaf_begin.push_back(i);
+				used = 0;
+			}
+			used += length;
+		}
+		const uint32_t leaves = leaf_begin.size();
+		const uint32_t per_node = htree::node_limit(block_size);
+		const uint32_t nodes = leaves <= htree::root_limit(block_size) ? 0 : (leaves + per_node - 1) / per_node;
+		if (nodes > htree::root_limit(block_size)) {
+			return false;
+		}
+		auto leaf_hash = [&](uint32_t leaf) -> uint32_t {
+			if (leaf == 0) {
+				return 0;
+			}
+			auto i = leaf_begin[leaf];
+			// the lowest bit marks a hash which continues from the previous leaf
+			return order[i].first | (order[i - 1].first == order[i].first ? 1 : 0);
+		};
+
+		std::vector<char> buffer((1ull + nodes + leaves) * block_size, 0);
+		directory_entry_list root{detail::directory_entry{dot, 12, 1, detail::directory_entry_type::directory, "."},
+					  detail::directory_entry{dotdot, 0, 2, detail::directory_entry_type::directory, ".."}};
+		root[1].size = block_size - 12;
+		detail::encode_directory_entry(&buffer[0], root[0]);
+		detail::encode_directory_entry(&buffer[12], root[1]);
+		htree::root_info info{0, version, 8, static_cast<uint8_t>(nodes == 0 ? 0 : 1), 0};
+		std::memcpy(&buffer[htree::root_info_offset], &info, sizeof(info));
+		htree::entries_view root_entries(&buffer[htree::root_entries_offset]);
+		root_entries.set_limit(htree::root_limit(block_size));
+		if (nodes == 0) {
+			root_entries.set_count(leaves);
+			for (auto leaf = 0u; leaf < leaves; leaf++) {
+				root_entries.set_hash(leaf, leaf_hash(leaf));
+				root_entries.set_block(leaf, 1 + leaf);
+			}
+		} else {
+			root_entries.set_count(nodes);
+			for (auto node = 0u; node < nodes; node++) {
+				char *block = &buffer[(1ull + node) * block_size];
+				init_node(block, block_size);
+				htree::entries_view node_entries(block + htree::node_entries_offset);
+				const uint32_t first = node * per_node;
+				const uint32_t count = std::min(per_node, leaves - first);
+				node_entries.set_count(count);
+				for (auto i = 0u; i < count; i++) {
+					node_entries.set_hash(i, leaf_hash(first + i));
+					node_entries.set_block(i, 1 + nodes + first + i);
+				}
+				root_entries.set_hash(node, leaf_hash(first));
+				root_entries.set_block(node, 1 + node);
+			}
+		}
+		for (auto leaf = 0u; leaf < leaves; leaf++) {
+			const uint32_t end = leaf + 1 < leaves ? leaf_begin[leaf + 1] : order.size();
+			directory_entry_list list;
+			list.reserve(end - leaf_begin[leaf]);
+			for (auto i = leaf_begin[leaf]; i < end; i++) {
+				list.push_back(*order[i].second);
+			}
+			detail::encode_directory_block(&buffer[(1ull + nodes + leaf) * block_size], block_size, list);
+		}
+
+		if (buffer.size() != this->size()) {
+			this->set_size(buffer.size());
+		}
+		this->write(0, buffer.data(), buffer.size());
+		this->data.flags |= detail::hash_dir;
+		this->mark_dirty();
+		this->flush();
+		return true;
+	}
+
+      public:
 	/*
 	 * returns false, if the given name is equal to ".." or "." and if the given name is a directory and not empty.
 	 */
 	bool remove(const std::string &name) {
-		auto entries = read_entries();
-		return remove(name, entries);
+		if (name == ".." || name == ".")
+			return false;
+
+		// one scan finds the entry, its block is changed in place
+		std::vector<char> block;
+		const auto offset = find_entry_block(name, block);
+		if (offset >= 0) {
+			uint32_t id;
+			std::memcpy(&id, &block[detail::find_in_directory_block(block.data(), block.size(), name)], 4);
+			if (!unlink_inode(id)) {
+				return false;
+			}
+			detail::remove_from_directory_block(block.data(), block.size(), name);
+			this->write(offset, block.data(), block.size());
+		}
+		this->fs()->dcache().insert(this->id(), name, 0);
+		return true;
 	}
 
 	/*
@@ -392,43 +1362,353 @@ template <typename Filesystem> struct directory : inode<Filesystem> {
 
 		auto iter = std::find_if(entries.begin(), entries.end(), [&name](auto &e) { return e.name == name; });
 		if (iter != entries.end()) {
-			auto inode = this->fs()->get_inode(iter->inode_id);
-			if (auto *dir = to_directory(&inode)) {
-				if (dir->read_entries().size() > 2) {
-					return false;
-				}
-			}
-
-			inode.data.count_hard_link--;
-			inode.save();
-			if (inode.data.count_hard_link == 0) {
-				// free inode
-				// TODO: set deletion time
-
-				if (!inode.is_symbolic_link() || inode.size() >= 60) {
-					// free block but do not reset the pointer to make recovery possible
-					auto i = 0u;
-					auto blockid = inode.get_block_id(i);
-					while (blockid != 0) {
-						this->fs()->free_block(blockid);
-						blockid = inode.get_block_id(++i);
-					}
-				}
-				this->fs()->free_inode(iter->inode_id);
+			if (!remove_inode(name, iter->inode_id)) {
+				return false;
 			}
 			entries.erase(iter);
-			write_entries(entries);
 		}
 		return true;
 	}
 
       private:
+	/* drops a link of the inode id and removes the entry name, returns false for a directory which is not empty */
+	bool remove_inode(const std::string &name, uint32_t id) {
+		if (!unlink_inode(id)) {
+			return false;
+		}
+		remove_entry(name);
+		this->fs()->dcache().insert(this->id(), name, 0);
+		return true;
+	}
+
+	/* drops a link of the inode id and frees it with the last one, returns false for a directory which is not empty */
+	bool unlink_inode(uint32_t id) {
+		auto inode = this->fs()->get_inode(id);
+		if (auto *dir = to_directory(&inode)) {
+			if (!dir->is_empty()) {
+				return false;
+			}
+		}
+
+		inode.data.count_hard_link--;
+		inode.save();
+		if (inode.data.count_hard_link == 0) {
+			// free inode
+			// TODO: set deletion time
+
+			if (!inode.is_symbolic_link() || inode.size() >= 60) {
+				// free block but do not reset the pointer to make recovery possible
+				this->fs()->free_blocks(inode.allocated_blocks());
+			}
+			this->fs()->free_inode(id);
+		}
+		return true;
+	}
+
+	/* a root or an interior node of the index on the way to a leaf */
+	struct index_frame {
+		uint32_t block;		// logical block of the directory
+		uint32_t offset;	// of the index entries in the block
+		uint16_t at;		// the followed index entry
+		std::vector<char> data; // the block
+
+		inline htree::entries_view entries() { return htree::entries_view(&data[offset]); }
+	};
+
+	struct index_path {
+		std::vector<index_frame> frames;
+		uint8_t hash_version;
+		uint32_t hash;
+	};
+
+	inline uint64_t block_address(uint32_t block) const { return static_cast<uint64_t>(block) << this->fs()->block_size_bits(); }
+	inline uint64_t leaf_address(index_path &path) const { return block_address(path.frames.back().entries().block(path.frames.back().at)); }
+
+	/* an interior node is a block with one unused entry over the whole block */
+	static void init_node(char *block, uint32_t block_size) {
+		std::memset(block, 0, block_size);
+		detail::directory_entry unused{0, static_cast<uint16_t>(block_size), 0, detail::directory_entry_type::unknown_type, ""};
+		detail::encode_directory_entry(block, unused);
+		htree::entries_view(block + htree::node_entries_offset).set_limit(htree::node_limit(block_size));
+	}
+
+	bool read_frame(index_frame &frame, uint32_t block) const {
+		frame.block = block;
+		if (block_address(block) + frame.data.size() > this->size()) {
+			return false;
+		}
+		this->read(block_address(block), frame.data.data(), frame.data.size());
+		return true;
+	}
+
+	/*
+	 * walks from the root to the leaf of the hash of name. returns false, if the index is corrupted or unknown. Such a directory is
+	 * still a valid linear directory.
+	 */
+	bool probe(const std::string &name, index_path &path) const {
+		const uint32_t block_size = this->fs()->block_size();
+		path.frames.clear();
+		path.frames.push_back(index_frame{0, htree::root_entries_offset, 0, std::vector<char>(block_size)});
+		if (!read_frame(path.frames.back(), 0)) {
+			return false;
+		}
+		htree::root_info info;
+		std::memcpy(&info, &path.frames.back().data[htree::root_info_offset], sizeof(info));
+		if (info.reserved_zero != 0 || info.info_length != 8 || info.hash_version > htree::tea || info.indirect_levels > htree::max_indirect_levels) {
+			return false;
+		}
+		path.hash_version = info.hash_version;
+		path.hash = this->fs()->dir_hash(name, info.hash_version);
+		for (uint8_t level = 0;; level++) {
+			auto &frame = path.frames.back();
+			auto entries = frame.entries();
+			const uint16_t limit = level == 0 ? htree::root_limit(block_size) : htree::node_limit(block_size);
+			if (entries.limit() != limit || entries.count() == 0 || entries.count() > limit) {
+				return false;
+			}
+			frame.at = entries.find(path.hash);
+			const uint32_t next = entries.block(frame.at);
+			if (level == info.indirect_levels) {
+				return block_address(next) + block_size <= this->size();
+			}
+			path.frames.push_back(index_frame{0, htree::node_entries_offset, 0, std::vector<char>(block_size)});
+			if (!read_frame(path.frames.back(), next)) {
+				return false;
+			}
+		}
+	}
+
+	/*
+	 * moves the path to the next leaf, if the hash continues there. Entries with the same hash may be spread over several leaves,
+	 * the lowest bit of the hash of the next leaf is set in this case.
+	 */
+	bool next_leaf(index_path &path) const {
+		auto level = path.frames.size();
+		while (level > 0 && path.frames[level - 1].at + 1 >= path.frames[level - 1].entries().count()) {
+			level--;
+		}
+		if (level == 0) {
+			return false;
+		}
+		auto &frame = path.frames[level - 1];
+		frame.at++;
+		if ((frame.entries().hash(frame.at) & ~1u) != path.hash) {
+			return false;
+		}
+		for (auto i = level; i < path.frames.size(); i++) {
+			auto &parent = path.frames[i - 1];
+			if (!read_frame(path.frames[i], parent.entries().block(parent.at))) {
+				return false;
+			}
+			path.frames[i].at = 0;
+		}
+		return true;
+	}
+
+	/* adds one block at the end of the directory and returns its logical block */
+	uint32_t append_block() {
+		const auto size = this->size();
+		this->set_size(size + this->fs()->block_size());
+		return size >> this->fs()->block_size_bits();
+	}
+
+	inline void write_frame(index_frame &frame) { this->write(block_address(frame.block), frame.data.data(), frame.data.size()); }
+
+	/*
+	 * makes room for one more entry in the node above the leaf. A full root moves its entries into a new node, a full node is split
+	 * into two. returns false, if all index blocks are full.
+	 */
+	bool make_index_space(index_path &path) {
+		const uint32_t block_size = this->fs()->block_size();
+		auto &frame = path.frames.back();
+		auto entries = frame.entries();
+		if (entries.count() < entries.limit()) {
+			return true;
+		}
+		if (path.frames.size() == 1) {
+			// add a level below the root
+			if (htree::max_indirect_levels == 0) {
+				return false;
+			}
+			index_frame node{append_block(), htree::node_entries_offset, frame.at, std::vector<char>(block_size)};
+			init_node(node.data.data(), block_size);
+			std::memcpy(&node.data[htree::node_entries_offset], &frame.data[htree::root_entries_offset], entries.count() * 8);
+			node.entries().set_limit(htree::node_limit(block_size));
+			entries.set_count(1);
+			entries.set_block(0, node.block);
+			frame.at = 0;
+			frame.data[htree::root_info_offset + offsetof(htree::root_info, indirect_levels)] = 1;
+			write_frame(node);
+			write_frame(frame);
+			path.frames.push_back(std::move(node));
+			return true;
+		}
+		auto &parent = path.frames[path.frames.size() - 2];
+		if (parent.entries().count() >= parent.entries().limit()) {
+			return false;
+		}
+		// move the upper half of the node into a new one
+		const uint16_t count = entries.count();
+		const uint16_t half = count / 2;
+		index_frame sibling{append_block(), htree::node_entries_offset, 0, std::vector<char>(block_size)};
+		init_node(sibling.data.data(), block_size);
+		std::memcpy(&sibling.data[htree::node_entries_offset], &frame.data[htree::node_entries_offset + half * 8], (count - half) * 8);
+		sibling.entries().set_limit(htree::node_limit(block_size));
+		sibling.entries().set_count(count - half);
+		const uint32_t split_hash = entries.hash(half);
+		entries.set_count(half);
+		parent.entries().insert(parent.at + 1, split_hash, sibling.block);
+		write_frame(frame);
+		write_frame(sibling);
+		write_frame(parent);
+		if (frame.at >= half) {
+			sibling.at = frame.at - half;
+			parent.at++;
+			frame = std::move(sibling);
+		}
+		return true;
+	}
+
+	/*
+	 * adds the entry to the leaf of its hash. A full leaf is split in the middle of its hash range, the upper half goes into a new block.
+	 * The entries of the lower half stay in place, unless the new one only fits after packing them.
+	 * returns false, if the index can not be used.
+	 */
+	bool insert_indexed(detail::directory_entry &e) {
+		const uint32_t block_size = this->fs()->block_size();
+		index_path path;
+		if (!probe(e.name, path)) {
+			return false;
+		}
+		std::vector<char> leaf(block_size);
+		const auto leaf_offset = leaf_address(path);
+		this->read(leaf_offset, leaf.data(), block_size);
+		if (detail::insert_into_directory_block(leaf.data(), block_size, e)) {
+			this->write(leaf_offset, leaf.data(), block_size);
+			return true;
+		}
+		directory_entry_list entries;
+		detail::parse_directory_block(leaf.data(), block_size, entries);
+		if (entries.empty() || !make_index_space(path)) {
+			return false;
+		}
+		entries.push_back(e);
+		std::vector<std::pair<uint32_t, uint32_t> > order; // (hash, index)
+		order.reserve(entries.size());
+		uint32_t total = 0;
+		for (auto i = 0u; i < entries.size(); i++) {
+			order.emplace_back(i + 1 < entries.size() ? this->fs()->dir_hash(entries[i].name, path.hash_version) : path.hash, i);
+			total += detail::directory_entry_length(entries[i].name.size());
+		}
+		std::stable_sort(order.begin(), order.end(), [](const auto &lhs, const auto &rhs) { return lhs.first < rhs.first; });
+		auto split = order.size() - 1;
+		uint32_t moved = detail::directory_entry_length(entries[order[split].second].name.size());
+		while (split > 1 && moved + detail::directory_entry_length(entries[order[split - 1].second].name.size()) <= total / 2) {
+			split--;
+			moved += detail::directory_entry_length(entries[order[split].second].name.size());
+		}
+		const uint32_t split_hash = order[split].first | (order[split - 1].first == order[split].first ? 1 : 0);
+
+		// the upper half is removed from the leaf, the entries which stay keep their place
+		const auto added = entries.size() - 1;
+		bool added_stays = true;
+		directory_entry_list upper;
+		for (auto i = split; i < order.size(); i++) {
+			if (order[i].second == added) {
+				added_stays = false;
+			} else {
+				detail::remove_from_directory_block(leaf.data(), block_size, entries[order[i].second].name);
+			}
+			upper.push_back(entries[order[i].second]);
+		}
+		std::vector<char> sibling(block_size);
+		if (!detail::encode_directory_block(sibling.data(), block_size, upper)) {
+			return false;
+		}
+		if (added_stays && !detail::insert_into_directory_block(leaf.data(), block_size, e)) {
+			// the free space of the leaf is scattered, it is packed
+			directory_entry_list lower;
+			for (auto i = 0u; i < split; i++) {
+				lower.push_back(std::move(entries[order[i].second]));
+			}
+			if (!detail::encode_directory_block(leaf.data(), block_size, lower)) {
+				return false;
+			}
+		}
+		const uint32_t sibling_block = append_block();
+		auto &parent = path.frames.back();
+		parent.entries().insert(parent.at + 1, split_hash, sibling_block);
+		this->write(leaf_offset, leaf.data(), block_size);
+		this->write(block_address(sibling_block), sibling.data(), block_size);
+		write_frame(parent);
+		return true;
+	}
+
+	/*
+	 * reads the block with the entry name into block and returns its offset in the directory or -1, if there is no such entry.
+	 * The blocks are read one by one up to the match, an indexed directory reads the leaves of the hash only.
+	 */
+	int64_t find_entry_block(const std::string &name, std::vector<char> &block) const {
+		const uint32_t block_size = this->fs()->block_size();
+		block.resize(block_size);
+		auto find = [&](uint64_t offset) {
+			this->read(offset, block.data(), block_size);
+			return detail::find_in_directory_block(block.data(), block_size, name) >= 0;
+		};
+		index_path path;
+		if (name != "." && name != ".." && is_indexed() && probe(name, path)) {
+			do {
+				const auto offset = leaf_address(path);
+				if (find(offset)) {
+					return offset;
+				}
+			} while (next_leaf(path));
+			return -1;
+		}
+		for (uint64_t offset = 0; offset + block_size <= this->size(); offset += block_size) {
+			if (find(offset)) {
+				return offset;
+			}
+		}
+		return -1;
+	}
+
+	uint32_t lookup_uncached(const std::string &name) const {
+		std::vector<char> block;
+		uint32_t result = 0;
+		if (find_entry_block(name, block) >= 0) {
+			std::memcpy(&result, &block[detail::find_in_directory_block(block.data(), block.size(), name)], 4);
+		}
+		return result;
+	}
+
+	/* turns an indexed directory into a linear one, which is always valid */
+	void drop_index() {
+		if (detail::has_flag(this->data.flags, detail::hash_dir)) {
+			this->data.flags &= ~detail::hash_dir;
+			this->mark_dirty();
+			this->flush();
+		}
+	}
+
+	/*
+	 * merges the rec_len of the entry into the previous entry of its block or marks it unused, if it is the first one.
+	 * Only that block is written. returns false, if there is no such entry.
+	 */
+	bool remove_entry(const std::string &name) {
+		std::vector<char> block;
+		const auto offset = find_entry_block(name, block);
+		if (offset < 0) {
+			return false;
+		}
+		detail::remove_from_directory_block(block.data(), block.size(), name);
+		this->write(offset, block.data(), block.size());
+		return true;
+	}
 };
 
 template <typename Filesystem> directory<Filesystem> &operator<<(directory<Filesystem> &dir, const detail::directory_entry &e) {
-	auto entry_list = dir.read_entries();
-	entry_list.push_back(e);
-	dir.write_entries(entry_list);
+	dir.insert(e);
 	return dir;
 }
 
@@ -0,0 +1,159 @@
+/*
+*
+*	Author: Philipp Zschoche, https://zschoche.org
+*
+*/
+#ifndef __INODE_CACHE_HPP__
+#define __INODE_CACHE_HPP__
+
+#include <list>
+#include <unordered_map>
+
+namespace ext2 {
+
+template <typename Cache> class inode_handle;
+
+/*
+ * keeps recently used inodes in memory.
+ * Entries which are referenced by a handle are pinned, all others are evicted in LRU order as soon as the capacity is exceeded.
+ * Dirty inodes are written back when their last handle is released or when they are evicted.
+ */
+template <typename Inode> class inode_cache {
+      public:
+	typedef Inode inode_type;
+	typedef inode_handle<inode_cache<Inode> > handle_type;
+
+	struct entry {
+		uint32_t id;
+		inode_type inode;
+		uint32_t refs;
+	};
+
+	inode_cache(size_t capacity = 1024) : _capacity(capacity) {}
+	/* cached inodes belong to exactly one filesystem, therefore a copy starts empty */
+	inode_cache(const inode_cache &other) : _capacity(other._capacity) {}
+	~inode_cache() { flush(); }
+	inode_cache &operator=(const inode_cache &other) {
+		flush();
+		lru.clear();
+		map.clear();
+		_capacity = other._capacity;
+		return *this;
+	}
+
+	/*
+	 * returns a handle to the cached inode. load(id) is only called on a miss.
+	 */
+	template <typename Loader> handle_type get(uint32_t id, Loader load) {
+		auto iter = map.find(id);
+		if (iter != map.end()) {
+			lru.splice(lru.begin(), lru, iter->second);
+			return handle_type(this, &lru.front());
+		}
+		lru.push_front(entry{id, load(id), 0});
+		map.emplace(id, lru.begin());
+		handle_type result(this, &lru.front());
+		shrink();
+		return result;
+	}
+
+	/*
+	 * adds an already loaded inode, if it is not cached yet
+	 */
+	void insert(uint32_t id, inode_type inode) {
+		if (map.find(id) == map.end()) {
+			lru.push_front(entry{id, std::move(inode), 0});
+			map.emplace(id, lru.begin());
+			shrink();
+		}
+	}
+
+	/* returns nullptr, if the inode is not cached */
+	entry *find(uint32_t id) {
+		auto iter = map.find(id);
+		return iter != map.end() ? &*(iter->second) : nullptr;
+	}
+
+	void put(entry *e) {
+		if (--e->refs == 0) {
+			e->inode.flush();
+			shrink();
+		}
+	}
+
+	/* writes back all dirty inodes */
+	void flush() {
+		for (auto &e : lru) {
+			e.inode.flush();
+		}
+	}
+
+	inline size_t size() const { return map.size(); }
+	inline size_t capacity() const { return _capacity; }
+	void set_capacity(size_t capacity) {
+		_capacity = capacity;
+		shrink();
+	}
+
+      private:
+	size_t _capacity;
+	std::list<entry> lru;
+	std::unordered_map<uint32_t, typename std::list<entry>::iterator> map;
+
+	void shrink() {
+		auto iter = lru.end();
+		while (map.size() > _capacity && iter != lru.begin()) {
+			--iter;
+			if (iter->refs == 0) {
+				iter->inode.flush();
+				map.erase(iter->id);
+				iter = lru.erase(iter);
+			}
+		}
+	}
+};
+
+/*
+ * reference counted handle to a cached inode. The inode stays in memory as long as a handle refers to it.
+ */
+template <typename Cache> class inode_handle {
+	Cache *cache;
+	typename Cache::entry *e;
+
+      public:
+	typedef typename Cache::inode_type inode_type;
+
+	inode_handle() : cache(nullptr), e(nullptr) {}
+	inode_handle(Cache *cache, typename Cache::entry *e) : cache(cache), e(e) { ++e->refs; }
+	inode_handle(const inode_handle &other) : cache(other.cache), e(other.e) {
+		if (e != nullptr)
+			++e->refs;
+	}
+	inode_handle(inode_handle &&other) : cache(other.cache), e(other.e) { other.e = nullptr; }
+	~inode_handle() { reset(); }
+
+	inode_handle &operator=(inode_handle other) {
+		std::swap(cache, other.cache);
+		std::swap(e, other.e);
+		return *this;
+	}
+
+	/* releases the inode and writes it back, if this was the last handle and it is dirty */
+	void reset() {
+		if (e != nullptr) {
+			auto *tmp = e;
+			e = nullptr;
+			cache->put(tmp);
+		}
+	}
+
+	inline uint32_t id() const { return e->id; }
+	inline inode_type *get() const { return &e->inode; }
+	inline inode_type *operator->() const { return get(); }
+	inline inode_type &operator*() const { return *get(); }
+	inline explicit operator bool() const { return e != nullptr; }
+};
+
+} /* namespace ext2 */
+
+#endif /* __INODE_CACHE_HPP__ */
@@ -0,0 +1,166 @@
+/*
+*
+*	Author: Philipp Zschoche, https://zschoche.org
+*
+*/
+#ifndef __INODE_STREAM_HPP__
+#define __INODE_STREAM_HPP__
+
+#include "inode.hpp"
+#include <istream>
+#include <streambuf>
+#include <vector>
+
+namespace ext2 {
+
+/*
+ * buffered std::streambuf over the content of an inode. The buffer is either a get or a put area, like std::filebuf.
+ * Transfers which are larger than the buffer go straight to the inode.
+ */
+template <typename Inode> class inode_streambuf : public std::streambuf {
+      public:
+	typedef Inode inode_type;
+
+	inode_streambuf(inode_type &inode, std::size_t buffer_size = 1024 * 1024) : inode(inode), buffer(buffer_size), pos(0) {}
+	inode_streambuf(const inode_streambuf &) = delete;
+	~inode_streambuf() { sync(); }
+
+	/* current read or write position */
+	inline uint64_t position() const { return pos + (gptr() - eback()) + (pptr() - pbase()); }
+
+      protected:
+	int_type underflow() override {
+		if (write_buffer() != 0) {
+			return traits_type::eof();
+		}
+		pos = position();
+		setg(nullptr, nullptr, nullptr);
+		if (pos >= inode.size()) {
+			return traits_type::eof();
+		}
+		auto length = std::min<uint64_t>(buffer.size(), inode.size() - pos);
+		inode.read(pos, buffer.data(), length);
+		setg(buffer.data(), buffer.data(), buffer.data() + length);
+		return traits_type::to_int_type(*gptr());
+	}
+
+	int_type overflow(int_type c = traits_type::eof()) override {
+		if (write_buffer() != 0) {
+			return traits_type::eof();
+		}
+		drop_get_area();
+		setp(buffer.data(), buffer.data() + buffer.size());
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize xsgetn(char *s, std::streamsize n) override {
+		if (static_cast<std::size_t>(n) < buffer.size()) {
+			return std::streambuf::xsgetn(s, n);
+		}
+		// take what is buffered and read the rest directly
+		std::streamsize result = std::min<std::streamsize>(n, egptr() - gptr());
+		std::copy(gptr(), gptr() + result, s);
+		gbump(result);
+		if (write_buffer() != 0) {
+			return result;
+		}
+		drop_get_area();
+		auto length = std::min<uint64_t>(n - result, pos < inode.size() ? inode.size() - pos : 0);
+		inode.read(pos, s + result, length);
+		pos += length;
+		return result + length;
+	}
+
+	std::streamsize xsputn(const char *s, std::streamsize n) override {
+		if (static_cast<std::size_t>(n) < buffer.size()) {
+			return std::streambuf::xsputn(s, n);
+		}
+		if (write_buffer() != 0) {
+			return 0;
+		}
+		drop_get_area();
+		try {
+			inode.write(pos, s, n);
+		} catch (const std::exception &) {
+			return 0;
+		}
+		pos += n;
+		return n;
+	}
+
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which = std::ios_base::in | std::ios_base::out) override {
+		uint64_t base = 0;
+		if (dir == std::ios_base::cur) {
+			base = position();
+		} else if (dir == std::ios_base::end) {
+			base = inode.size();
+		}
+		return seekpos(static_cast<off_type>(base) + off, which);
+	}
+
+	pos_type seekpos(pos_type sp, std::ios_base::openmode which = std::ios_base::in | std::ios_base::out) override {
+		if (write_buffer() != 0) {
+			return pos_type(off_type(-1));
+		}
+		off_type target = sp;
+		if (target < 0 || static_cast<uint64_t>(target) > inode.size()) {
+			return pos_type(off_type(-1));
+		}
+		setg(nullptr, nullptr, nullptr);
+		pos = target;
+		return sp;
+	}
+
+	/* writes the put area to the inode and flushes the inode */
+	int sync() override {
+		auto result = write_buffer();
+		inode.flush();
+		return result;
+	}
+
+      private:
+	inode_type &inode;
+	std::vector<char> buffer;
+	uint64_t pos; // inode offset of the beginning of the buffer
+
+	/* writes the put area to the inode. returns -1 on failure */
+	int write_buffer() {
+		if (pptr() == pbase()) {
+			setp(nullptr, nullptr);
+			return 0;
+		}
+		auto length = pptr() - pbase();
+		try {
+			inode.write(pos, pbase(), length);
+		} catch (const std::exception &) {
+			return -1;
+		}
+		pos += length;
+		setp(nullptr, nullptr);
+		return 0;
+	}
+
+	/* moves pos to the read position and empties the get area */
+	void drop_get_area() {
+		pos += gptr() - eback();
+		setg(nullptr, nullptr, nullptr);
+	}
+};
+
+/*
+ * std::iostream over the content of an inode
+ */
+template <typename Inode> class inode_stream : public std::iostream {
+	inode_streambuf<Inode> buf;
+
+      public:
+	inode_stream(Inode &inode, std::size_t buffer_size = 1024 * 1024) : std::iostream(nullptr), buf(inode, buffer_size) { rdbuf(&buf); }
+};
+
+} /* namespace ext2 */
+
+#endif /* __INODE_STREAM_HPP__ */
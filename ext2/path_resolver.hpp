@@ -0,0 +1,66 @@
+/*
+*
+*	Author: Philipp Zschoche, https://zschoche.org
+*
+*/
+#ifndef __PATH_RESOLVER_HPP__
+#define __PATH_RESOLVER_HPP__
+
+#include "filesystem.hpp"
+
+namespace ext2 {
+
+/* like MAXSYMLINKS of Linux */
+constexpr unsigned max_symlinks_default = 40;
+
+/*
+ * returns the inode id of path or 0, if there is no such inode. Relative paths start at the directory start, absolute ones at "/".
+ * The path is walked component by component with one directory lookup each, only the inodes of the matches are loaded.
+ * Symbolic links are followed without recursion: the components of the target replace the link, a relative target continues in the
+ * directory of the link. A path which runs through more than max_symlinks links is not found, so a loop ends.
+ * If follow_last is false, a symbolic link at the end of the path is returned itself.
+ */
+template <typename Filesystem>
+uint32_t resolve_path(Filesystem &fs, const path &p, bool follow_last = true, uint32_t start = 2, unsigned max_symlinks = max_symlinks_default) {
+	// the components which are left, the next one is at the back
+	std::vector<std::string> pending(p.vec.rbegin(), p.vec.rend());
+	auto inode = fs.iget(p.is_relative() ? start : 2);
+	unsigned symlinks = 0;
+	while (!pending.empty()) {
+		const auto *dir = to_directory(inode.get());
+		if (dir == nullptr) {
+			return 0;
+		}
+		const auto id = dir->lookup(pending.back());
+		pending.pop_back();
+		if (id == 0) {
+			return 0;
+		}
+		if (pending.empty() && !follow_last) {
+			return id;
+		}
+		auto next = fs.iget(id);
+		if (const auto *symlink = to_symbolic_link(next.get())) {
+			if (++symlinks > max_symlinks) {
+				return 0;
+			}
+			auto target = path_from_string(symlink->get_target());
+			pending.insert(pending.end(), target.vec.rbegin(), target.vec.rend());
+			if (!target.is_relative()) {
+				inode = fs.iget(2);
+			}
+			continue;
+		}
+		inode = std::move(next);
+	}
+	return inode.id();
+}
+
+template <typename Filesystem>
+uint32_t resolve_path(Filesystem &fs, const std::string &p, bool follow_last = true, uint32_t start = 2, unsigned max_symlinks = max_symlinks_default) {
+	return resolve_path(fs, path_from_string(p), follow_last, start, max_symlinks);
+}
+
+} /* namespace ext2 */
+
+#endif /* __PATH_RESOLVER_HPP__ */
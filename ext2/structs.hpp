@@ -112,6 +112,16 @@ template <typename OStream> OStream &operator<<(OStream &os, const readonly_feat
 	return os;
 }
 
+enum superblock_flags : uint32_t {
+	superblock_flag_signed_hash = 0x0001,   // the directory hash uses signed chars
+	superblock_flag_unsigned_hash = 0x0002, // the directory hash uses unsigned chars
+	superblock_flag_test_filesystem = 0x0004
+};
+template <typename OStream> OStream &operator<<(OStream &os, const superblock_flags &val) {
+	os << static_cast<const uint32_t>(val);
+	return os;
+}
+
 
 
 namespace os {
@@ -237,7 +247,7 @@ enum inode_flags : uint32_t {
 	append = 0x00000020,	   /* Append only */
 	no_dump = 0x00000040,	  /* File is not included in 'dump' command */
 	no_last_accessed = 0x00000080, /* Last accessed time should not updated */
-	hash_dir = 0x00010000,	 /* Hash indexed directory */
+	hash_dir = 0x00001000,	 /* Hash indexed directory */
 	afs_dir = 0x00020000,	  /* AFS directory */
 	journal = 0x00040000	   /* Journal file data */
 };
@@ -431,6 +441,33 @@ struct __attribute__((packed)) superblock {
 	}
 };
 
+/*
+* the fields behind the superblock, which are used by indexed directories. They start at byte 236 of the superblock.
+*/
+struct __attribute__((packed)) superblock_extension {
+	uint32_t hash_seed[4];           // seed of the directory hash
+	uint8_t default_hash_version;    // hash version of new indexed directories
+	uint8_t journal_backup_type;     // unused
+	uint16_t group_descriptor_size;  // unused
+	uint32_t default_mount_options;  // default mount options
+	uint32_t first_meta_block_group; // unused
+	uint32_t mkfs_time;              // creation time of the filesystem (in posix time)
+	uint32_t journal_blocks[17];     // unused
+	uint32_t block_count_hi;	 // unused
+	uint32_t reserved_blocks_count_hi; // unused
+	uint32_t free_block_count_hi;    // unused
+	uint16_t inode_extra_size_min;   // unused
+	uint16_t inode_extra_size_want;  // unused
+	superblock_flags flags;          // misc flags
+
+	template <typename OStream> void dump(OStream &os) const {
+		os << "Superblock Extension Dump:\n";
+		os << "\tdefault_hash_version: " << static_cast<uint32_t>(default_hash_version) << '\n';
+		os << "\tflags: " << flags << '\n';
+		os << '\n';
+	}
+};
+
 inline bool operator==(const superblock &lhs, const superblock &rhs) {
 	return std::strncmp(reinterpret_cast<const char *>(&lhs), reinterpret_cast<const char *>(&rhs), sizeof(superblock)) == 0;
 }
@@ -7,6 +7,7 @@
 #define __VISITORS_HPP__
 
 #include "filesystem.hpp"
+#include "path_resolver.hpp"
 
 namespace ext2 {
 
@@ -32,13 +33,18 @@ template <typename T, bool VISIT_DOT_AND_DOTDOT = false> struct visitor {
 
 		ops result = explore;
 		if (const auto *dir = to_directory(&inode)) {
-			auto list = dir->read_entries();
-			for (auto entry : list) {
-				if (VISIT_DOT_AND_DOTDOT) {
-					result = lookup(entry, inode);
-				} else if (entry.name != "." && entry.name != "..") {
-					result = lookup(entry, inode);
+			// one pass over the directory, the inodes of all entries are loaded before they are visited
+			std::vector<std::pair<uint32_t, std::string> > children;
+			std::vector<uint32_t> ids;
+			for (const auto &entry : dir->entries()) {
+				if (VISIT_DOT_AND_DOTDOT || (entry.name != "." && entry.name != "..")) {
+					children.emplace_back(entry.inode_id, entry.name.to_string());
+					ids.push_back(entry.inode_id);
 				}
+			}
+			inode.fs()->prefetch_inodes(std::move(ids));
+			for (auto &child : children) {
+				result = lookup(child.first, child.second, inode);
 				if (result == cancel)
 					break;
 			}
@@ -51,11 +57,11 @@ template <typename T, bool VISIT_DOT_AND_DOTDOT = false> struct visitor {
       private:
 	inode_path _path;
 
-	template <typename Inode> ops lookup(detail::directory_entry &entry, Inode &inode) {
+	template <typename Inode> ops lookup(uint32_t inode_id, std::string &name, Inode &inode) {
 		ops result = explore;
-		_path.push_back(std::make_pair(entry.inode_id, &entry.name));
-		auto next = inode.fs()->get_inode(entry.inode_id);
-		result = (*derived())(entry.name, &next);
+		_path.push_back(std::make_pair(inode_id, &name));
+		auto next = inode.fs()->get_inode(inode_id);
+		result = (*derived())(name, &next);
 		if (result == explore) {
 			result = visit(next);
 		}
@@ -81,62 +87,20 @@ template <typename OStream> struct printer : visitor<printer<OStream> > {
 	OStream &os;
 };
 
-template<typename Filesystem>
-struct finder : visitor<finder<Filesystem>, true> {
-
-	typedef Filesystem fs_type;
-	typedef typename fs_type::inode_type inode_type;
-	path target;
-	path::vec_type::const_iterator pos;
-	bool hide_symlink = true;
-	uint32_t inode_id = 0;
-
-	finder(path target) : target(std::move(target)), pos(this->target.vec.cbegin()) {}
-
-	ops operator()(const std::string &name, inode_type *inode) {
-		if (name == *pos) {
-			pos++;
-			if(auto* dir = to_directory(inode)) {
-				cur_dir = dir;
-			}
-
-			if (hide_symlink || pos != target.vec.cend()) {
-			if (auto *symlink = to_symbolic_link(inode) ) { // follow
-				explore_symlink(symlink);
-				return cancel;
-			}
-			}
-			if (pos == target.vec.cend()) {
-				inode_id = this->get_current_path()->back().first;
-				return cancel;
-			}
-			return explore;
-		}
-		return forward;
-	}
+/*
+ * collects the inode ids of all directories below the visited one, except /lost+found. e2fsck needs its preallocated blocks.
+ */
+struct directory_collector : visitor<directory_collector> {
+	std::vector<uint32_t> ids;
 
-      private:
-	inode_type* cur_dir = nullptr;
-	void explore_symlink(typename fs_type::symbolic_link_type *link) {
-		std::string path_str = link->get_target();
-		if(path_str.back() != '/') 
-			path_str += '/';
-
-		for(auto iter = pos; iter != target.vec.end(); iter++) {
-			path_str += *iter;
-			path_str += '/';
+	template <typename Inode> ops operator()(const std::string &name, Inode *inode) {
+		if (name == "lost+found" && this->get_current_path()->size() == 1) {
+			return forward;
 		}
-
-		
-		path p = path_from_string(path_str);
-		finder f(p);
-		if (p.is_relative() && cur_dir != nullptr) {
-			f.visit(*cur_dir);
-		} else {
-			auto root = link->fs()->get_root();
-			f.visit(root);
+		if (inode->is_directory()) {
+			ids.push_back(this->get_current_path()->back().first);
 		}
-		inode_id = f.inode_id;
+		return explore;
 	}
 };
 
@@ -149,11 +113,33 @@ template <typename OStream, typename Inode> OStream &print(OStream &os, const In
 	return os;
 }
 
+/*
+ * compacts the directory and all directories below it with directory::compact() and returns the number of freed blocks.
+ * The tree is walked first, because compacting a directory invalidates the iteration over it.
+ */
+template <typename Inode> uint64_t compact_directories(Inode &inode) {
+	visitors::directory_collector collector;
+	collector.visit(inode);
+	uint64_t result = 0;
+	if (auto *dir = to_directory(&inode)) {
+		result += dir->compact();
+	}
+	for (auto id : collector.ids) {
+		auto next = inode.fs()->get_inode(id);
+		if (auto *dir = to_directory(&next)) {
+			result += dir->compact();
+		}
+	}
+	return result;
+}
+
+/*
+ * returns the inode id of path below inode or 0, see resolve_path(). If hide_symlink is false, a symbolic link at the end is not followed.
+ */
 template <typename Inode> uint32_t find_inode(Inode &inode, const ext2::path &path, bool hide_symlink = true) {
-	visitors::finder<typename Inode::fs_type> f(path);
-	f.hide_symlink = hide_symlink;
-	f.visit(inode);
-	return f.inode_id;
+	// the path starts at inode, also if it is absolute
+	const ext2::path relative{std::string(), path.vec};
+	return resolve_path(*inode.fs(), relative, hide_symlink, inode.id());
 }
 template <typename Inode> uint32_t find_inode(Inode &inode, const std::string &path, bool hide_symlink = true) {
 	return find_inode(inode, path_from_string(path), hide_symlink);
@@ -51,15 +51,15 @@ struct raw_device {
 
 };
 
-template<typename Inode>
+template<typename InodeHandle>
 struct filehandle {
-	Inode inode;
+	InodeHandle inode;
 
 };
 
 typedef raw_device 	device_type;
 typedef ext2::filesystem<device_type> filesystem_type;
-typedef filehandle<filesystem_type::inode_type> fh_type;
+typedef filehandle<filesystem_type::inode_handle_type> fh_type;
 typedef std::unordered_map<int, fh_type> filehandle_table_type;
 extern filesystem_type* fs;
 extern filehandle_table_type fd_table;
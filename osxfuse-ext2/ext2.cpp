@@ -12,18 +12,18 @@ int fuse_getattr(const char *path_str, struct stat *stbuf) {
 	if(inode_id == 0) {
 		return -ENOENT;
 	}
-	auto inode = fs->get_inode(inode_id);	
+	auto inode = fs->iget(inode_id);	
 	stbuf->st_ino = inode_id;
-	stbuf->st_mode = inode.data.type;
-	stbuf->st_nlink = inode.data.count_hard_link;
-	stbuf->st_uid = inode.data.uid;
-	stbuf->st_gid = inode.data.gid;
-	stbuf->st_size = inode.size();
-	stbuf->st_flags = inode.data.flags;
-	stbuf->st_gen = inode.data.number_generation;
-	stbuf->st_atime = inode.data.access_time_last;
-	stbuf->st_mtime = inode.data.mod_time;
-	stbuf->st_ctime = inode.data.creation_time;
+	stbuf->st_mode = inode->data.type;
+	stbuf->st_nlink = inode->data.count_hard_link;
+	stbuf->st_uid = inode->data.uid;
+	stbuf->st_gid = inode->data.gid;
+	stbuf->st_size = inode->size();
+	stbuf->st_flags = inode->data.flags;
+	stbuf->st_gen = inode->data.number_generation;
+	stbuf->st_atime = inode->data.access_time_last;
+	stbuf->st_mtime = inode->data.mod_time;
+	stbuf->st_ctime = inode->data.creation_time;
 	return 0;
 }
 
@@ -39,7 +39,7 @@ int fuse_open(const char *path_str, struct fuse_file_info *fi) {
 		return -ENOENT;
 	}
 	fi->fh = ++fd_next;
-	fd_table.insert({ fi->fh, fh_type{ fs->get_inode(inode_id) } });
+	fd_table.insert({ fi->fh, fh_type{ fs->iget(inode_id) } });
 	//TODO: check flags
 	return 0;
 }
@@ -62,9 +62,15 @@ int fuse_readdir(const char *path_str, void *buf, fuse_fill_dir_t filler, off_t
 	}
 	auto inode = fs->get_inode(inode_id);	
 	if(auto* d = ext2::to_directory(&inode)) {
-		auto entries = d->read_entries();
-		for(const auto& e : entries) {
-			filler(buf, e.name.c_str(), NULL, 0);
+		// offset is 0 or the cookie of the last entry, which was passed to filler
+		auto range = d->entries(std::max<off_t>(offset, 0));
+		std::string name;
+		for(auto iter = range.begin(); iter != range.end(); ++iter) {
+			name.assign(iter->name.data(), iter->name.size());
+			if(filler(buf, name.c_str(), NULL, iter.cookie()) != 0) {
+				// the buffer is full, the next call continues behind the last cookie
+				break;
+			}
 		}
 	} else {
 		return -EINVAL;
@@ -78,11 +84,11 @@ int fuse_read(const char *path, char *buf, size_t size, off_t offset, struct fus
 		return -ENOENT;
 	}
 
-	auto file_size = iter->second.inode.size();
+	auto file_size = iter->second.inode->size();
 	if (offset >= file_size) /* Trying to read past the end of file. */
 		return 0;
 	size = std::min<size_t>(size, file_size - offset);
-	iter->second.inode.read(offset, buf, size);
+	iter->second.inode->read(offset, buf, size);
 	return size;
 }
 
@@ -7,6 +7,7 @@
 #define __HOST_NODE_HPP__
 
 #include <fstream>
+#include <map>
 #include <string>
 
 /*
@@ -59,6 +60,11 @@ class host_node /* : public iposix::fs::i_fs_node*/ {
 		return size;
 	}
 
+	/* path of the image on the host */
+	const std::string &path() const {
+		return filename;
+	}
+
 
 
 };
@@ -86,5 +92,34 @@ class test_node /* : public iposix::fs::i_fs_node*/ {
 
 
 
+};
+
+/*
+ * forwards every call to Device and counts them
+ */
+template<typename Device>
+class counting_node : public Device {
+
+	public:
+	mutable uint32_t reads = 0;
+	uint32_t writes = 0;
+	mutable std::map<uint64_t, uint32_t> reads_at;
+	std::map<uint64_t, uint32_t> writes_at;
+
+	template<typename... Args>
+	counting_node(Args &&... args) : Device(std::forward<Args>(args)...) {}
+
+	uint32_t read(const uint64_t offset, char *buffer, uint32_t length) const {
+		++reads;
+		++reads_at[offset];
+		return Device::read(offset, buffer, length);
+	}
+
+	uint32_t write(const uint64_t offset, const char *buffer, uint32_t length) {
+		++writes;
+		++writes_at[offset];
+		return Device::write(offset, buffer, length);
+	}
+
 };
 #endif /* __HOST_NODE_HPP__ */
@@ -6,8 +6,13 @@
 #include "../ext2/filesystem.hpp"
 #include "../ext2/block_device.hpp"
 #include "../ext2/visitors.hpp"
+#include "../ext2/inode_stream.hpp"
+#include "../ext2/host_io.hpp"
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <set>
 
 BOOST_AUTO_TEST_CASE(boost_test_test) { BOOST_REQUIRE_EQUAL(true, true); }
 
@@ -1030,3 +1035,1636 @@ BOOST_AUTO_TEST_CASE(remove_test) {
 
 	std::remove("remove_test.img");
 }
+
+BOOST_AUTO_TEST_CASE(inode_cache_test) {
+	counting_node<host_node> image("image.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+
+	auto inode = filesystem.get_inode(13);
+	auto reads = image.reads;
+	auto inode2 = filesystem.get_inode(13);
+	BOOST_REQUIRE_EQUAL(image.reads, reads); // cache hit
+	BOOST_CHECK(std::memcmp(&inode.data, &inode2.data, sizeof(inode.data)) == 0);
+	{
+		auto handle = filesystem.iget(13);
+		BOOST_REQUIRE_EQUAL(handle.id(), 13);
+		BOOST_REQUIRE_EQUAL(handle->size(), inode.size());
+		BOOST_REQUIRE_EQUAL(image.reads, reads);
+	}
+
+	filesystem.set_inode_cache_capacity(1);
+	{
+		auto handle = filesystem.iget(13);
+		filesystem.get_inode(2); // 13 is pinned by handle
+		reads = image.reads;
+		filesystem.get_inode(13);
+		BOOST_REQUIRE_EQUAL(image.reads, reads);
+	}
+	filesystem.get_inode(2); // evicts 13
+	reads = image.reads;
+	filesystem.get_inode(13);
+	BOOST_REQUIRE_EQUAL(image.reads, reads + 1);
+}
+
+BOOST_AUTO_TEST_CASE(inode_cache_writeback_test) {
+	std::remove("inode_cache_writeback_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("inode_cache_writeback_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	host_node image("inode_cache_writeback_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto uid = filesystem.get_inode(13).data.uid;
+	{
+		auto handle = filesystem.iget(13);
+		handle->data.uid = uid + 1;
+		handle->mark_dirty();
+		BOOST_REQUIRE_EQUAL(filesystem.get_inode(13).data.uid, uid + 1);
+		BOOST_REQUIRE_EQUAL(ext2::read_filesystem(image).get_inode(13).data.uid, uid); // not written yet
+	}
+	BOOST_REQUIRE_EQUAL(ext2::read_filesystem(image).get_inode(13).data.uid, uid + 1);
+
+	// saving a copy updates the cache
+	auto inode = filesystem.get_inode(13);
+	inode.data.uid = uid;
+	inode.save();
+	BOOST_REQUIRE_EQUAL(filesystem.get_inode(13).data.uid, uid);
+	BOOST_REQUIRE_EQUAL(ext2::read_filesystem(image).get_inode(13).data.uid, uid);
+	std::remove("inode_cache_writeback_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(load_inodes_test) {
+	counting_node<host_node> image("image.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	const auto superblock = ext2::read_superblock(image);
+	const auto per_group = superblock.data.inodes_per_group;
+	// the inodes are compared with the ones of a filesystem which reads them one by one
+	host_node reference_image("image.img", 1024 * 1024 * 10);
+	auto reference = ext2::read_filesystem(reference_image);
+	auto same = [&](uint32_t id) {
+		auto loaded = filesystem.get_inode(id);
+		auto expected = reference.get_inode(id);
+		return std::memcmp(&loaded.data, &expected.data, sizeof(loaded.data)) == 0;
+	};
+
+	// a range over the end of a block group is read with one read per group
+	BOOST_REQUIRE(superblock.data.inode_count >= per_group + 9);
+	auto reads = image.reads;
+	filesystem.load_inodes(per_group - 7, 16);
+	BOOST_REQUIRE_EQUAL(image.reads, reads + 2);
+	for (auto id = per_group - 7; id < per_group + 9; id++) {
+		BOOST_CHECK(same(id));
+	}
+	BOOST_REQUIRE_EQUAL(image.reads, reads + 2);
+
+	// the inodes of a directory
+	auto root = filesystem.get_root();
+	std::vector<uint32_t> ids;
+	for (const auto &e : ext2::to_directory(&root)->read_entries()) {
+		ids.push_back(e.inode_id);
+	}
+	filesystem.set_inode_cache_capacity(0);
+	filesystem.set_inode_cache_capacity(ids.size() + 8);
+	reads = image.reads;
+	filesystem.prefetch_inodes(ids);
+	BOOST_CHECK(image.reads > reads);
+	BOOST_CHECK(image.reads - reads <= ids.size());
+	reads = image.reads;
+	for (auto id : ids) {
+		BOOST_CHECK(same(id));
+	}
+	BOOST_REQUIRE_EQUAL(image.reads, reads);
+}
+
+BOOST_AUTO_TEST_CASE(inode_write_count_test) {
+	std::remove("inode_write_count_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("inode_write_count_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("inode_write_count_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto inode = filesystem.get_inode(13);
+	auto* file = ext2::to_file(&inode);
+	BOOST_CHECK(file != nullptr);
+
+	std::string msg(20 * 1024, 'x'); // needs the indirect block
+	file->write(file->size(), msg.c_str(), msg.size());
+	BOOST_REQUIRE_EQUAL(image.writes_at[inode.offset()], 1);
+	file->write(file->size(), msg.c_str(), 100);
+	BOOST_REQUIRE_EQUAL(image.writes_at[inode.offset()], 2);
+	file->write(0, msg.c_str(), 100); // size does not change
+	BOOST_REQUIRE_EQUAL(image.writes_at[inode.offset()], 2);
+
+	auto filesystem2 = ext2::read_filesystem(image);
+	auto inode2 = filesystem2.get_inode(13);
+	std::stringstream ss;
+	ss << *ext2::to_file(&inode2);
+	BOOST_CHECK(ss.str() == std::string(21 + msg.size() + 100, 'x'));
+	std::remove("inode_write_count_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(indirect_block_cache_test) {
+	counting_node<host_node> image("image.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto root = filesystem.get_root();
+
+	uint32_t inode_id = ext2::find_inode(root, "/tmp2/testdir/largefile");
+	auto inode = filesystem.get_inode(inode_id);
+	auto* file = ext2::to_file(&inode);
+	BOOST_CHECK(file != nullptr);
+	BOOST_CHECK(inode.data.block_pointer_indirect[0] != 0);
+
+	std::string str;
+	for(int i = 0; i < 672; i++) {
+		str += "a bit more content.\n";
+	}
+	for(int i = 0; i < 2; i++) {
+		std::stringstream ss;
+		ss << *file;
+		BOOST_CHECK(ss.str() == str);
+	}
+	BOOST_REQUIRE_EQUAL(image.reads_at[filesystem.to_address(inode.data.block_pointer_indirect[0], 0)], 1);
+}
+
+BOOST_AUTO_TEST_CASE(map_extents_test) {
+	host_node image("image.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto root = filesystem.get_root();
+
+	uint32_t inode_id = ext2::find_inode(root, "/tmp2/testdir/largefile");
+	auto inode = filesystem.get_inode(inode_id);
+	auto extents = inode.map_extents(0, inode.size());
+	BOOST_CHECK(!extents.empty());
+
+	std::string content;
+	uint32_t next = 0;
+	for (const auto &e : extents) {
+		BOOST_REQUIRE_EQUAL(e.logical, next);
+		BOOST_CHECK(e.physical != 0);
+		std::string buffer(e.length * filesystem.block_size(), '\0');
+		image.read(filesystem.to_address(e.physical, 0), &buffer[0], buffer.size());
+		content += buffer;
+		next += e.length;
+	}
+	BOOST_REQUIRE_EQUAL(next, (inode.size() + filesystem.block_size() - 1) / filesystem.block_size());
+	std::string str;
+	for(int i = 0; i < 672; i++) {
+		str += "a bit more content.\n";
+	}
+	BOOST_CHECK(content.substr(0, inode.size()) == str);
+
+	auto part = inode.map_extents(1500, 100);
+	BOOST_REQUIRE_EQUAL(part.size(), 1);
+	BOOST_REQUIRE_EQUAL(part[0].logical, 1);
+	BOOST_REQUIRE_EQUAL(part[0].length, 1);
+	BOOST_REQUIRE_EQUAL(inode.map_extents(inode.size(), 100).size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(read_extents_test) {
+	counting_node<host_node> image("image.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto root = filesystem.get_root();
+
+	uint32_t inode_id = ext2::find_inode(root, "/tmp2/testdir/largefile");
+	auto inode = filesystem.get_inode(inode_id);
+	std::string str;
+	for(int i = 0; i < 672; i++) {
+		str += "a bit more content.\n";
+	}
+
+	auto extents = inode.map_extents(0, inode.size());
+	std::string buffer(inode.size(), '\0');
+	inode.read(0, &buffer[0], buffer.size()); // loads the indirect block
+	auto reads = image.reads;
+	inode.read(0, &buffer[0], buffer.size());
+	BOOST_CHECK(buffer == str);
+	BOOST_REQUIRE_EQUAL(image.reads, reads + extents.size()); // one read per extent
+
+	buffer.assign(5000, '\0');
+	inode.read(1000, &buffer[0], buffer.size()); // partial first and last block
+	BOOST_CHECK(buffer == str.substr(1000, 5000));
+
+	inode.data.block_pointer_direct[1] = 0; // not saved, just a hole
+	buffer.assign(3000, 'x');
+	inode.read(0, &buffer[0], buffer.size());
+	BOOST_CHECK(buffer == str.substr(0, 1024) + std::string(1024, '\0') + str.substr(2048, 952));
+}
+
+BOOST_AUTO_TEST_CASE(read_fragmented_file_test) {
+	std::remove("read_fragmented_file_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("read_fragmented_file_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("read_fragmented_file_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto a = filesystem.create_file();
+	auto b = filesystem.create_file();
+	auto c = filesystem.create_file();
+	std::string block(filesystem.block_size(), 'a');
+	for (auto i = 0u; i < 10; i++) {
+		// a and b are interleaved
+		a.second.write(a.second.size(), block.c_str(), block.size());
+		b.second.write(b.second.size(), block.c_str(), block.size());
+	}
+	std::string data(10 * filesystem.block_size(), 'c');
+	c.second.write(0, data.c_str(), data.size());
+
+	auto fragments = a.second.map_extents(0, a.second.size()).size();
+	BOOST_CHECK(fragments > 5);
+	BOOST_REQUIRE_EQUAL(c.second.map_extents(0, c.second.size()).size(), 1);
+
+	std::string buffer(data.size(), '\0');
+	auto reads = image.reads;
+	a.second.read(0, &buffer[0], buffer.size());
+	BOOST_CHECK(buffer == std::string(data.size(), 'a'));
+	BOOST_REQUIRE_EQUAL(image.reads, reads + fragments);
+	reads = image.reads;
+	c.second.read(0, &buffer[0], buffer.size());
+	BOOST_CHECK(buffer == data);
+	BOOST_REQUIRE_EQUAL(image.reads, reads + 1);
+	std::remove("read_fragmented_file_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(extend_file_test) {
+	std::remove("extend_file_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("extend_file_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("extend_file_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto file = filesystem.create_file();
+	const uint64_t size = 2 * 1024 * 1024;
+	const auto blocks = size / filesystem.block_size();
+	auto free_blocks = ext2::read_superblock(image).data.free_block_count;
+	auto writes = image.writes;
+	file.second.set_size(size);
+	BOOST_REQUIRE_EQUAL(file.second.size(), size);
+	// one write per indirect block, a few bitmaps, group descriptors, the super block and the inode
+	BOOST_CHECK(image.writes - writes < blocks / 32);
+	BOOST_CHECK(ext2::read_superblock(image).data.free_block_count < free_blocks - blocks);
+	BOOST_REQUIRE_EQUAL(file.second.data.count_sector, (free_blocks - ext2::read_superblock(image).data.free_block_count) * (filesystem.block_size() / 512));
+
+	uint64_t mapped = 0;
+	for (auto &e : file.second.map_extents(0, size)) {
+		BOOST_CHECK(e.physical != 0);
+		mapped += e.length;
+	}
+	BOOST_REQUIRE_EQUAL(mapped, blocks);
+
+	std::string data("end of file");
+	file.second.write(size - data.size(), data.c_str(), data.size());
+	std::string buffer(data.size(), '\0');
+	ext2::read_filesystem(image).get_inode(file.first).read(size - data.size(), &buffer[0], buffer.size());
+	BOOST_CHECK(buffer == data);
+	std::remove("extend_file_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(truncate_file_test) {
+	std::remove("truncate_file_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("truncate_file_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("truncate_file_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto free_blocks = ext2::read_superblock(image).data.free_block_count;
+	auto file = filesystem.create_file();
+	// needs the doubly-indirect tree
+	file.second.set_size(2 * 1024 * 1024);
+	std::string data(2 * filesystem.block_size(), 'a');
+	file.second.write(0, data.c_str(), data.size());
+
+	auto writes = image.writes;
+	file.second.set_size(data.size());
+	BOOST_CHECK(image.writes - writes < 16);
+	BOOST_REQUIRE_EQUAL(file.second.size(), data.size());
+	BOOST_REQUIRE_EQUAL(file.second.data.block_pointer_indirect[0], 0);
+	BOOST_REQUIRE_EQUAL(file.second.data.block_pointer_indirect[1], 0);
+	BOOST_REQUIRE_EQUAL(file.second.data.count_sector, 2 * (filesystem.block_size() / 512));
+	BOOST_REQUIRE_EQUAL(ext2::read_superblock(image).data.free_block_count, free_blocks - 2);
+
+	std::string buffer(data.size(), '\0');
+	ext2::read_filesystem(image).get_inode(file.first).read(0, &buffer[0], buffer.size());
+	BOOST_CHECK(buffer == data);
+
+	file.second.set_size(0);
+	BOOST_REQUIRE_EQUAL(file.second.data.count_sector, 0);
+	BOOST_REQUIRE_EQUAL(ext2::read_superblock(image).data.free_block_count, free_blocks);
+	std::remove("truncate_file_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(remove_large_file_test) {
+	std::remove("remove_large_file_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("remove_large_file_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("remove_large_file_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto root = filesystem.get_root();
+	auto* dir = ext2::to_directory(&root);
+	auto free_blocks = ext2::read_superblock(image).data.free_block_count;
+	{
+		auto file = filesystem.create_file();
+		file.second.set_size(2 * 1024 * 1024);
+		*dir << ext2::create_directory_entry("large", file.first, file.second);
+	}
+	auto free_blocks_dir = ext2::read_superblock(image).data.free_block_count + (2 * 1024 * 1024 / filesystem.block_size());
+
+	auto writes = image.writes;
+	BOOST_REQUIRE_EQUAL(dir->remove("large"), true);
+	BOOST_CHECK(image.writes - writes < 32);
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(root, "/large"), 0);
+	// the indirect blocks are released too
+	BOOST_CHECK(ext2::read_superblock(image).data.free_block_count > free_blocks_dir);
+	BOOST_CHECK(ext2::read_superblock(image).data.free_block_count >= free_blocks - 1);
+	std::remove("remove_large_file_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(fill_holes_test) {
+	std::remove("fill_holes_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("fill_holes_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("fill_holes_test.img", 1024 * 1024 * 10);
+	uint32_t file_id;
+	uint64_t indirect_address;
+	const auto bs = ext2::read_superblock(image).data.block_size();
+	{
+		auto filesystem = ext2::read_filesystem(image);
+		auto file = filesystem.create_file();
+		file_id = file.first;
+		file.second.set_size(64 * bs);
+		// punch holes into the indirect tree
+		indirect_address = filesystem.to_address(file.second.data.block_pointer_indirect[0], 0);
+		std::vector<char> zeros((64 - 12) * 4, 0);
+		image.write(indirect_address, zeros.data(), zeros.size());
+	}
+	auto filesystem = ext2::read_filesystem(image);
+	auto file = filesystem.get_inode(file_id);
+	BOOST_REQUIRE_EQUAL(file.map_extents(12 * bs, 52 * bs).front().physical, 0);
+
+	auto indirect_writes = [&]() {
+		uint32_t result = 0;
+		for (auto iter = image.writes_at.lower_bound(indirect_address); iter != image.writes_at.end() && iter->first < indirect_address + bs; ++iter) {
+			result += iter->second;
+		}
+		return result;
+	};
+	auto writes = indirect_writes();
+	std::string data(52 * bs, 'h');
+	file.write(12 * bs, data.c_str(), data.size());
+	// the indirect block is changed in memory and written once
+	BOOST_REQUIRE_EQUAL(indirect_writes(), writes + 1);
+
+	for (auto &e : file.map_extents(0, file.size())) {
+		BOOST_CHECK(e.physical != 0);
+	}
+	std::string buffer(data.size(), '\0');
+	ext2::read_filesystem(image).get_inode(file_id).read(12 * bs, &buffer[0], buffer.size());
+	BOOST_CHECK(buffer == data);
+	std::remove("fill_holes_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(block_size_specialization_test) {
+	host_node image("image.img", 1024 * 1024 * 10);
+	auto runtime = ext2::read_filesystem(image);
+	BOOST_REQUIRE_EQUAL(runtime.block_size(), 1024);
+	BOOST_REQUIRE_EQUAL(runtime.block_size_bits(), 10);
+	BOOST_CHECK_THROW(ext2::read_filesystem<12>(image), ext2::error::block_size_error);
+
+	auto filesystem = ext2::read_filesystem<10>(image);
+	BOOST_REQUIRE_EQUAL(filesystem.block_size(), 1024);
+	auto root = filesystem.get_root();
+	auto id = ext2::find_inode(root, "/tmp2/testdir/largefile");
+	auto inode = filesystem.get_inode(id);
+	auto runtime_inode = runtime.get_inode(id);
+	std::string buffer(inode.size(), '\0');
+	std::string runtime_buffer(runtime_inode.size(), '\0');
+	inode.read(0, &buffer[0], buffer.size());
+	runtime_inode.read(0, &runtime_buffer[0], runtime_buffer.size());
+	BOOST_CHECK(buffer == runtime_buffer);
+	BOOST_REQUIRE_EQUAL(inode.map_extents(0, inode.size()).size(), runtime_inode.map_extents(0, runtime_inode.size()).size());
+
+	auto size = ext2::with_filesystem(image, [](auto fs) { return fs.block_size_bits(); });
+	BOOST_REQUIRE_EQUAL(size, 10);
+}
+
+BOOST_AUTO_TEST_CASE(inode_stream_test) {
+	std::remove("inode_stream_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("inode_stream_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("inode_stream_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto file = filesystem.create_file();
+	std::string expected;
+	auto writes = image.writes;
+	{
+		ext2::inode_stream<decltype(file.second)> os(file.second, 64 * 1024);
+		for (int i = 0; i < 10000; i++) {
+			os << "line " << i << '\n';
+			expected += "line " + std::to_string(i) + '\n';
+		}
+		std::string large(200 * 1024, 'x'); // larger than the buffer
+		os.write(large.c_str(), large.size());
+		expected += large;
+		os << "end\n";
+		expected += "end\n";
+	}
+	BOOST_REQUIRE_EQUAL(file.second.size(), expected.size());
+	// the data goes through in a few large writes instead of one per <<
+	BOOST_CHECK(image.writes - writes < 1000);
+
+	ext2::inode_stream<decltype(file.second)> is(file.second, 4096);
+	std::string line;
+	std::getline(is, line);
+	BOOST_REQUIRE_EQUAL(line, "line 0");
+	is.seekg(expected.find("line 5000"));
+	std::getline(is, line);
+	BOOST_REQUIRE_EQUAL(line, "line 5000");
+	BOOST_REQUIRE_EQUAL(static_cast<uint64_t>(is.tellg()), expected.find("line 5001"));
+	is.seekg(-4, std::ios::end);
+	std::getline(is, line);
+	BOOST_REQUIRE_EQUAL(line, "end");
+
+	is.clear();
+	is.seekg(0);
+	std::string content(expected.size(), '\0');
+	is.read(&content[0], content.size());
+	BOOST_REQUIRE_EQUAL(is.gcount(), expected.size());
+	BOOST_CHECK(content == expected);
+	BOOST_CHECK(is.seekg(expected.size() + 1).fail());
+
+	// overwrite in the middle
+	is.clear();
+	is.seekp(5);
+	is << "X";
+	is.flush();
+	char c;
+	file.second.read(5, &c, 1);
+	BOOST_REQUIRE_EQUAL(c, 'X');
+	std::remove("inode_stream_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(copy_to_fd_test) {
+	counting_node<host_node> image("image.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto root = filesystem.get_root();
+	auto inode = filesystem.get_inode(ext2::find_inode(root, "/tmp2/testdir/largefile"));
+	std::string expected(inode.size(), '\0');
+	inode.read(0, &expected[0], expected.size());
+	inode.data.block_pointer_direct[1] = 0; // not saved, just a hole
+	std::fill(expected.begin() + 1024, expected.begin() + 2048, '\0');
+
+	auto copy = [&](int image_fd, uint64_t buffer_size) {
+		std::remove("copy_to_fd_test.out");
+		int fd = ::open("copy_to_fd_test.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		BOOST_REQUIRE(fd >= 0);
+		BOOST_REQUIRE_EQUAL(ext2::copy_to_fd(inode, fd, image_fd, buffer_size), expected.size());
+		::close(fd);
+		std::ifstream is("copy_to_fd_test.out", std::ios::binary);
+		std::string result((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+		std::remove("copy_to_fd_test.out");
+		return result;
+	};
+
+	// through the device
+	auto reads = image.reads;
+	BOOST_CHECK(copy(-1, 1000) == expected);
+	BOOST_CHECK(image.reads > reads);
+
+	// in the kernel, the device is not touched
+	int image_fd = ::open("image.img", O_RDONLY);
+	BOOST_REQUIRE(image_fd >= 0);
+	reads = image.reads;
+	BOOST_CHECK(copy(image_fd, 1000) == expected);
+	BOOST_REQUIRE_EQUAL(image.reads, reads);
+	::close(image_fd);
+}
+
+BOOST_AUTO_TEST_CASE(import_file_test) {
+	std::remove("import_file_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("import_file_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	std::string content;
+	for (int i = 0; i < 100000; i++) {
+		content += std::to_string(i) + ' ';
+	}
+	{
+		std::ofstream host("import_file_test.host", std::ios::binary);
+		host << content;
+	}
+	counting_node<host_node> image("import_file_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto root = filesystem.get_root();
+	auto* dir = ext2::to_directory(&root);
+
+	// through the device
+	auto writes = image.writes;
+	auto id = ext2::import_file(*dir, "imported", "import_file_test.host");
+	BOOST_CHECK(image.writes - writes < 100);
+	// by the kernel
+	int image_fd = ::open("import_file_test.img", O_RDWR);
+	BOOST_REQUIRE(image_fd >= 0);
+	writes = image.writes;
+	auto id2 = ext2::import_file(*dir, "imported2", "import_file_test.host", image_fd);
+	BOOST_CHECK(image.writes - writes < 100);
+	::close(image_fd);
+	BOOST_CHECK_THROW(ext2::import_file(*dir, "missing", "import_file_test.missing"), ext2::error::host_io_error);
+
+	auto fs = ext2::read_filesystem(image);
+	auto fs_root = fs.get_root();
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(fs_root, "/imported"), id);
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(fs_root, "/imported2"), id2);
+	for (auto inode_id : {id, id2}) {
+		auto inode = fs.get_inode(inode_id);
+		BOOST_REQUIRE_EQUAL(inode.size(), content.size());
+		BOOST_REQUIRE_EQUAL(inode.data.count_hard_link, 1);
+		std::string buffer(inode.size(), '\0');
+		inode.read(0, &buffer[0], buffer.size());
+		BOOST_CHECK(buffer == content);
+	}
+	std::remove("import_file_test.host");
+	std::remove("import_file_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(prepare_import_test) {
+	std::remove("prepare_import_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("prepare_import_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	std::vector<std::string> contents{std::string(5000, 'a'), std::string(), std::string(70000, 'c')};
+	for (auto i = 0u; i < contents.size(); i++) {
+		std::ofstream host("prepare_import_test.host" + std::to_string(i), std::ios::binary);
+		host << contents[i];
+	}
+	host_node image("prepare_import_test.img", 1024 * 1024 * 10);
+	std::vector<ext2::import_job> jobs;
+	{
+		auto filesystem = ext2::read_filesystem(image);
+		auto root = filesystem.get_root();
+		auto* dir = ext2::to_directory(&root);
+		for (auto i = 0u; i < contents.size(); i++) {
+			jobs.push_back(ext2::prepare_import(*dir, "file" + std::to_string(i), "prepare_import_test.host" + std::to_string(i)));
+		}
+	}
+	int image_fd = ::open("prepare_import_test.img", O_RDWR);
+	BOOST_REQUIRE(image_fd >= 0);
+	// the jobs are independent of each other and of the filesystem
+	for (auto iter = jobs.rbegin(); iter != jobs.rend(); ++iter) {
+		ext2::run_import(*iter, image_fd, 4096);
+	}
+	::close(image_fd);
+
+	auto filesystem = ext2::read_filesystem(image);
+	auto root = filesystem.get_root();
+	for (auto i = 0u; i < contents.size(); i++) {
+		auto id = ext2::find_inode(root, "/file" + std::to_string(i));
+		BOOST_REQUIRE_EQUAL(id, jobs[i].inode_id);
+		auto inode = filesystem.get_inode(id);
+		std::string buffer(inode.size(), '\0');
+		inode.read(0, &buffer[0], buffer.size());
+		BOOST_CHECK(buffer == contents[i]);
+		std::remove(("prepare_import_test.host" + std::to_string(i)).c_str());
+	}
+	std::remove("prepare_import_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(read_large_directory_test) {
+	std::remove("read_large_directory_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("read_large_directory_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("read_large_directory_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto id_dir = filesystem.create_directory(2);
+	auto* dir = ext2::to_directory(&id_dir.second);
+	ext2::directory_entry_list entries = dir->read_entries();
+	for (auto i = 0u; i < 1000; i++) {
+		std::string name = "file_with_a_long_name_" + std::to_string(i);
+		entries.push_back(ext2::detail::directory_entry{2, 0, 0, ext2::detail::directory_entry_type::regular_file, name});
+	}
+	dir->write_entries(entries);
+	const auto block_size = filesystem.block_size();
+	BOOST_REQUIRE_EQUAL(dir->size() % block_size, 0);
+
+	auto reads = image.reads;
+	auto result = dir->read_entries();
+	// one read per extent instead of two per entry
+	BOOST_REQUIRE_EQUAL(image.reads - reads, dir->map_extents(0, dir->size()).size());
+	BOOST_REQUIRE_EQUAL(result.size(), entries.size());
+	uint64_t offset = 0;
+	for (auto i = 0u; i < result.size(); i++) {
+		BOOST_CHECK(result[i].name == entries[i].name);
+		BOOST_REQUIRE_EQUAL(result[i].size % 4, 0);
+		// entries never cross the end of a block
+		BOOST_CHECK((offset % block_size) + result[i].size <= block_size);
+		offset += result[i].size;
+	}
+	BOOST_REQUIRE_EQUAL(offset, dir->size());
+
+	// the directory keeps its blocks, the ones behind the entries are empty
+	const auto size = dir->size();
+	entries.resize(2);
+	dir->write_entries(entries);
+	BOOST_REQUIRE_EQUAL(dir->size(), size);
+	BOOST_REQUIRE_EQUAL(dir->read_entries().size(), 2);
+	std::remove("read_large_directory_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(insert_directory_entry_test) {
+	std::remove("insert_directory_entry_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("insert_directory_entry_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("insert_directory_entry_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	const auto block_size = filesystem.block_size();
+	auto id_dir = filesystem.create_directory(2);
+	auto* dir = ext2::to_directory(&id_dir.second);
+
+	for (auto i = 0u; i < 500; i++) {
+		std::string name = "entry_" + std::to_string(i);
+		auto writes = image.writes;
+		auto size = dir->size();
+		*dir << ext2::detail::directory_entry{2, 0, 0, ext2::detail::directory_entry_type::regular_file, name};
+		if (dir->size() == size) {
+			// only the block with the free space is written
+			BOOST_REQUIRE_EQUAL(image.writes - writes, 1);
+		}
+	}
+	auto entries = dir->read_entries();
+	BOOST_REQUIRE_EQUAL(entries.size(), 502);
+	BOOST_REQUIRE_EQUAL(dir->size() % block_size, 0);
+	uint64_t offset = 0;
+	for (auto i = 2u; i < entries.size(); i++) {
+		BOOST_CHECK(entries[i].name == "entry_" + std::to_string(i - 2));
+	}
+	for (const auto &e : entries) {
+		BOOST_CHECK((offset % block_size) + e.size <= block_size);
+		offset += e.size;
+	}
+	BOOST_REQUIRE_EQUAL(offset, dir->size());
+	// the blocks are filled before a new one is added
+	BOOST_CHECK(dir->size() <= ((502 * 20) / block_size + 1) * block_size);
+	std::remove("insert_directory_entry_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(insert_directory_entry_first_block_test) {
+	std::remove("insert_directory_entry_first_block_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("insert_directory_entry_first_block_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("insert_directory_entry_first_block_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	const auto block_size = filesystem.block_size();
+	auto id_dir = filesystem.create_directory(2);
+	auto* dir = ext2::to_directory(&id_dir.second);
+	auto entries = dir->read_entries();
+	for (auto i = 0u; i < 500; i++) {
+		entries.push_back(ext2::detail::directory_entry{2, 0, 0, ext2::detail::directory_entry_type::regular_file, "entry_" + std::to_string(i)});
+	}
+	dir->write_entries(entries);
+	entries.resize(2);
+	dir->write_entries(entries);
+	const auto size = dir->size();
+	BOOST_REQUIRE(size > block_size);
+
+	// the first block has space, the others are not read
+	auto reads = image.reads;
+	auto writes = image.writes;
+	*dir << ext2::detail::directory_entry{2, 0, 0, ext2::detail::directory_entry_type::regular_file, "first"};
+	BOOST_REQUIRE_EQUAL(image.reads - reads, 1);
+	BOOST_REQUIRE_EQUAL(image.writes - writes, 1);
+	BOOST_REQUIRE_EQUAL(dir->size(), size);
+	BOOST_REQUIRE_EQUAL(dir->lookup("first"), 2);
+
+	// a directory of an older version, which ends inside a block, is completed to the end of the block
+	auto id_legacy = filesystem.create_directory(2);
+	auto* legacy = ext2::to_directory(&id_legacy.second);
+	{
+		std::vector<char> buffer(block_size + block_size / 2, 0);
+		legacy->read(0, buffer.data(), block_size);
+		ext2::detail::directory_entry last{2, static_cast<uint16_t>(block_size / 2), 6, ext2::detail::directory_entry_type::regular_file, "legacy"};
+		ext2::detail::encode_directory_entry(&buffer[block_size], last);
+		legacy->write(0, buffer.data(), buffer.size());
+	}
+	std::vector<std::string> added;
+	for (auto i = 0u; i < 100; i++) {
+		added.push_back("behind_" + std::to_string(i));
+		*legacy << ext2::detail::directory_entry{2, 0, 0, ext2::detail::directory_entry_type::regular_file, added.back()};
+	}
+	BOOST_REQUIRE_EQUAL(legacy->size() % block_size, 0);
+	BOOST_REQUIRE_EQUAL(legacy->read_entries().size(), 103);
+	BOOST_REQUIRE_EQUAL(legacy->lookup("legacy"), 2);
+	for (const auto &name : added) {
+		BOOST_REQUIRE_EQUAL(legacy->lookup(name), 2);
+	}
+	std::vector<char> buffer(legacy->size());
+	legacy->read(0, buffer.data(), buffer.size());
+	for (uint64_t block = 0; block < buffer.size(); block += block_size) {
+		uint32_t offset = 0;
+		while (offset < block_size) {
+			uint16_t size;
+			std::memcpy(&size, &buffer[block + offset + 4], 2);
+			BOOST_REQUIRE(size >= 8);
+			offset += size;
+		}
+		BOOST_REQUIRE_EQUAL(offset, block_size);
+	}
+	std::remove("insert_directory_entry_first_block_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(remove_directory_entry_test) {
+	std::remove("remove_directory_entry_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("remove_directory_entry_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("remove_directory_entry_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	const auto block_size = filesystem.block_size();
+	auto id_dir = filesystem.create_directory(2);
+	auto* dir = ext2::to_directory(&id_dir.second);
+	for (auto i = 0u; i < 200; i++) {
+		auto file = filesystem.create_file();
+		*dir << ext2::create_directory_entry("entry_" + std::to_string(i), file.first, file.second);
+	}
+	auto dir_writes = [&]() {
+		uint32_t result = 0;
+		for (const auto &e : dir->map_extents(0, dir->size())) {
+			auto begin = filesystem.to_address(e.physical, 0);
+			auto end = begin + (static_cast<uint64_t>(e.length) * block_size);
+			for (auto iter = image.writes_at.lower_bound(begin); iter != image.writes_at.end() && iter->first < end; ++iter) {
+				result += iter->second;
+			}
+		}
+		return result;
+	};
+	auto dir_reads = [&]() {
+		uint32_t result = 0;
+		for (const auto &e : dir->map_extents(0, dir->size())) {
+			auto begin = filesystem.to_address(e.physical, 0);
+			auto end = begin + (static_cast<uint64_t>(e.length) * block_size);
+			for (auto iter = image.reads_at.lower_bound(begin); iter != image.reads_at.end() && iter->first < end; ++iter) {
+				result += iter->second;
+			}
+		}
+		return result;
+	};
+
+	auto entries = dir->read_entries();
+	uint64_t offset = 0;
+	std::vector<std::string> first_in_block;
+	for (const auto &e : entries) {
+		if (offset % block_size == 0 && e.name != ".") {
+			first_in_block.push_back(e.name);
+		}
+		offset += e.size;
+	}
+	BOOST_REQUIRE(!first_in_block.empty());
+	std::vector<std::string> removed{"entry_7", "entry_199", first_in_block.front()};
+	for (const auto &name : removed) {
+		auto writes = dir_writes();
+		auto reads = dir_reads();
+		BOOST_REQUIRE_EQUAL(dir->remove(name), true);
+		BOOST_REQUIRE_EQUAL(dir_writes(), writes + 1);
+		// one scan up to the block of the entry
+		BOOST_CHECK(dir_reads() - reads <= dir->size() / block_size);
+	}
+
+	auto result = dir->read_entries();
+	BOOST_REQUIRE_EQUAL(result.size(), entries.size() - removed.size());
+	for (const auto &name : removed) {
+		BOOST_CHECK(ext2::find_entry_by_name(result, name) == result.end());
+	}
+	BOOST_CHECK(ext2::find_entry_by_name(result, "entry_8") != result.end());
+	// the space of a removed entry is used again
+	auto writes = dir_writes();
+	auto size = dir->size();
+	auto file = filesystem.create_file();
+	*dir << ext2::create_directory_entry("entry_7", file.first, file.second);
+	BOOST_REQUIRE_EQUAL(dir->size(), size);
+	BOOST_REQUIRE_EQUAL(dir_writes(), writes + 1);
+	BOOST_REQUIRE_EQUAL(dir->read_entries().size(), result.size() + 1);
+	std::remove("remove_directory_entry_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(htree_directory_test) {
+	// values of debugfs dx_hash
+	const uint32_t seed[4] = {0, 0, 0, 0};
+	BOOST_REQUIRE_EQUAL(ext2::htree::hash("hello", 5, ext2::htree::legacy, seed), 0x32252546);
+	BOOST_REQUIRE_EQUAL(ext2::htree::hash("hello", 5, ext2::htree::half_md4, seed), 0x1746da32);
+	BOOST_REQUIRE_EQUAL(ext2::htree::hash("hello", 5, ext2::htree::tea, seed), 0x6f5bb1a8);
+	BOOST_REQUIRE_EQUAL(ext2::htree::hash("\xe4\xf6\xfc", 3, ext2::htree::half_md4, seed), 0x448e01ca);
+	BOOST_REQUIRE_EQUAL(ext2::htree::hash("\xe4\xf6\xfc", 3, ext2::htree::half_md4_unsigned, seed), 0xbb482680);
+
+	std::remove("htree_directory_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("htree_directory_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("htree_directory_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto root = filesystem.get_root();
+	auto id_dir = filesystem.create_directory(2);
+	auto *dir = ext2::to_directory(&id_dir.second);
+	*ext2::to_directory(&root) << ext2::create_directory_entry("indexed", id_dir.first, id_dir.second);
+	// one file with a link for each entry
+	auto file = filesystem.create_file();
+	file.second.data.count_hard_link = 4000;
+	file.second.save();
+	const uint32_t id = file.first;
+	auto name = [](uint32_t i) { return "file_with_a_long_name_" + std::to_string(i); };
+	for (auto i = 0u; i < 300; i++) {
+		*dir << ext2::detail::directory_entry{id, 0, 0, ext2::detail::directory_entry_type::regular_file, name(i)};
+	}
+	BOOST_REQUIRE_EQUAL(dir->is_indexed(), false);
+	BOOST_REQUIRE_EQUAL(dir->build_index(), true);
+	BOOST_REQUIRE_EQUAL(dir->is_indexed(), true);
+	BOOST_REQUIRE_EQUAL(dir->read_entries().size(), 302);
+
+	// the leaves are split and a level of index blocks is added
+	for (auto i = 300u; i < 4000; i++) {
+		*dir << ext2::detail::directory_entry{id, 0, 0, ext2::detail::directory_entry_type::regular_file, name(i)};
+	}
+	BOOST_REQUIRE_EQUAL(dir->is_indexed(), true);
+	BOOST_REQUIRE_EQUAL(dir->read_entries().size(), 4002);
+	for (auto i = 0u; i < 4000; i += 7) {
+		auto reads = image.reads;
+		BOOST_REQUIRE_EQUAL(dir->lookup(name(i)), id);
+		// root, interior node and leaf
+		BOOST_CHECK(image.reads - reads <= 4);
+	}
+	BOOST_REQUIRE_EQUAL(dir->lookup("missing"), 0);
+	BOOST_REQUIRE_EQUAL(dir->lookup("."), id_dir.first);
+	BOOST_REQUIRE_EQUAL(dir->lookup(".."), 2);
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(root, "/indexed/" + name(1234)), id);
+
+	for (auto i = 0u; i < 4000; i += 3) {
+		BOOST_REQUIRE(dir->remove(name(i)));
+	}
+	for (auto i = 0u; i < 4000; i++) {
+		BOOST_REQUIRE_EQUAL(dir->lookup(name(i)), i % 3 == 0 ? 0 : id);
+	}
+
+	// a linear rewrite drops the index
+	auto entries = dir->read_entries();
+	dir->write_entries(entries);
+	BOOST_REQUIRE_EQUAL(dir->is_indexed(), false);
+	BOOST_REQUIRE_EQUAL(dir->lookup(name(1)), id);
+	std::remove("htree_directory_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(dentry_cache_test) {
+	ext2::dentry_cache cache(3);
+	uint32_t id = 42;
+	BOOST_REQUIRE_EQUAL(cache.find(2, "a", id), false);
+	cache.insert(2, "a", 11);
+	cache.insert(2, "b", 0);
+	cache.insert(12, "c", 13);
+	BOOST_REQUIRE_EQUAL(cache.find(2, "a", id), true);
+	BOOST_REQUIRE_EQUAL(id, 11);
+	BOOST_REQUIRE_EQUAL(cache.find(2, "b", id), true);
+	BOOST_REQUIRE_EQUAL(id, 0);
+	// "c" is the least recently used entry
+	cache.insert(2, "d", 14);
+	BOOST_REQUIRE_EQUAL(cache.size(), 3);
+	BOOST_REQUIRE_EQUAL(cache.find(12, "c", id), false);
+	cache.erase_directory(2);
+	BOOST_REQUIRE_EQUAL(cache.size(), 0);
+
+	std::remove("dentry_cache_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("dentry_cache_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("dentry_cache_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto root = filesystem.get_root();
+	auto largefile = ext2::find_inode(root, "/tmp2/testdir/largefile");
+	BOOST_REQUIRE(largefile != 0);
+	// the second walk reads neither directories nor inodes
+	auto reads = image.reads;
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(root, "/tmp2/testdir/largefile"), largefile);
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(root, "/tmp2/testdir/missing"), 0);
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(root, "/tmp2/testdir/missing"), 0);
+	BOOST_CHECK(image.reads - reads <= 1);
+	reads = image.reads;
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(root, "/tmp2/testdir/missing"), 0);
+	BOOST_REQUIRE_EQUAL(image.reads, reads);
+
+	// changes of the directory are visible
+	auto testdir = filesystem.get_inode(ext2::find_inode(root, "/tmp2/testdir"));
+	auto *dir = ext2::to_directory(&testdir);
+	auto file = filesystem.create_file();
+	*dir << ext2::create_directory_entry("missing", file.first, file.second);
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(root, "/tmp2/testdir/missing"), file.first);
+	BOOST_REQUIRE(dir->remove("missing"));
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(root, "/tmp2/testdir/missing"), 0);
+	BOOST_REQUIRE(dir->remove("largefile"));
+	BOOST_REQUIRE_EQUAL(dir->lookup("largefile"), 0);
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(root, "/tmp2/testdir/largefile"), 0);
+	std::remove("dentry_cache_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(insert_batch_test) {
+	std::remove("insert_batch_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("insert_batch_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("insert_batch_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	const auto block_size = filesystem.block_size();
+	auto file = filesystem.create_file();
+	file.second.data.count_hard_link = 5000;
+	file.second.save();
+	auto entry = [&](const std::string &name) { return ext2::detail::directory_entry{file.first, 0, 0, ext2::detail::directory_entry_type::regular_file, name}; };
+	// every name is found and listed once, the rec_len chain of every block ends at its end
+	auto check = [&](ext2::inodes::directory<decltype(filesystem)> *dir, const ext2::directory_entry_list &batch) {
+		BOOST_REQUIRE_EQUAL(dir->size() % block_size, 0);
+		std::map<std::string, uint32_t> count;
+		for (const auto &e : dir->read_entries()) {
+			count[e.name]++;
+		}
+		for (const auto &e : batch) {
+			BOOST_CHECK_EQUAL(count[e.name], 1);
+			BOOST_CHECK_EQUAL(dir->lookup(e.name), file.first);
+		}
+		std::vector<char> buffer(dir->size());
+		dir->read(0, buffer.data(), buffer.size());
+		for (uint64_t block = 0; block < buffer.size(); block += block_size) {
+			uint32_t offset = 0;
+			while (offset < block_size) {
+				uint16_t size;
+				std::memcpy(&size, &buffer[block + offset + 4], 2);
+				BOOST_REQUIRE(size >= 8);
+				offset += size;
+			}
+			BOOST_REQUIRE_EQUAL(offset, block_size);
+		}
+	};
+
+	// a linear directory with free space in its last block
+	auto id_dir = filesystem.create_directory(2);
+	auto *dir = ext2::to_directory(&id_dir.second);
+	auto entries = dir->read_entries();
+	for (auto i = 0u; i < 100; i++) {
+		entries.push_back(entry("old_" + std::to_string(i)));
+	}
+	dir->write_entries(entries);
+	ext2::directory_entry_list batch;
+	for (auto i = 0u; i < 1000; i++) {
+		batch.push_back(entry("new_" + std::to_string(i)));
+	}
+	auto writes_at = image.writes_at;
+	dir->insert_batch(batch);
+	BOOST_REQUIRE_EQUAL(dir->is_indexed(), false);
+	// every block is written once
+	for (const auto &e : dir->map_extents(0, dir->size())) {
+		for (auto i = 0u; i < e.length; i++) {
+			auto address = filesystem.to_address(e.physical + i, 0);
+			BOOST_CHECK(image.writes_at[address] - writes_at[address] <= 1);
+		}
+	}
+	check(dir, batch);
+	BOOST_REQUIRE_EQUAL(dir->read_entries().size(), 1102);
+
+	// a directory of an older version, which ends inside a block
+	auto id_legacy = filesystem.create_directory(2);
+	auto *legacy = ext2::to_directory(&id_legacy.second);
+	{
+		std::vector<char> buffer(block_size + block_size / 2, 0);
+		legacy->read(0, buffer.data(), block_size);
+		auto first = entry("legacy_0");
+		first.name_size = first.name.size();
+		first.size = 20;
+		auto last = entry("legacy_1");
+		last.name_size = last.name.size();
+		last.size = block_size / 2 - 20;
+		ext2::detail::encode_directory_entry(&buffer[block_size], first);
+		ext2::detail::encode_directory_entry(&buffer[block_size + 20], last);
+		legacy->write(0, buffer.data(), buffer.size());
+	}
+	BOOST_REQUIRE_EQUAL(legacy->size() % block_size, block_size / 2);
+	batch.clear();
+	for (auto i = 0u; i < 200; i++) {
+		batch.push_back(entry("batch_" + std::to_string(i)));
+	}
+	legacy->insert_batch(batch);
+	BOOST_REQUIRE_EQUAL(legacy->is_indexed(), false);
+	check(legacy, batch);
+	BOOST_REQUIRE_EQUAL(legacy->read_entries().size(), 204);
+	BOOST_REQUIRE_EQUAL(legacy->lookup("legacy_1"), file.first);
+
+	// a directory is not indexed automatically, like with insert()
+	auto id_dir2 = filesystem.create_directory(2);
+	auto *dir2 = ext2::to_directory(&id_dir2.second);
+	batch.clear();
+	for (auto i = 0u; i < 3000; i++) {
+		batch.push_back(entry("file_" + std::to_string(i)));
+	}
+	dir2->insert_batch(batch);
+	BOOST_REQUIRE_EQUAL(dir2->is_indexed(), false);
+	check(dir2, batch);
+	BOOST_REQUIRE_EQUAL(dir2->read_entries().size(), 3002);
+
+	// an indexed directory stays indexed, the entries go into the free space of their leaves or split them
+	BOOST_REQUIRE_EQUAL(dir2->build_index(), true);
+	batch.clear();
+	for (auto i = 0u; i < 3000; i += 100) {
+		const auto name = "file_" + std::to_string(i);
+		BOOST_REQUIRE_EQUAL(dir2->remove(name), true);
+		batch.push_back(entry(name));
+	}
+	for (auto i = 0u; i < 20; i++) {
+		batch.push_back(entry("late_entry_" + std::to_string(i)));
+	}
+	dir2->insert_batch(batch);
+	BOOST_REQUIRE_EQUAL(dir2->is_indexed(), true);
+	check(dir2, batch);
+	BOOST_REQUIRE_EQUAL(dir2->read_entries().size(), 3022);
+	std::remove("insert_batch_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(directory_iterator_test) {
+	std::remove("directory_iterator_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("directory_iterator_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("directory_iterator_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto file = filesystem.create_file();
+	file.second.data.count_hard_link = 1000;
+	file.second.save();
+
+	auto id_dir = filesystem.create_directory(2);
+	auto *dir = ext2::to_directory(&id_dir.second);
+	BOOST_REQUIRE_EQUAL(dir->is_empty(), true);
+	auto entries = dir->read_entries();
+	for (auto i = 0u; i < 1000; i++) {
+		entries.push_back(ext2::detail::directory_entry{file.first, 0, 0, ext2::detail::directory_entry_type::regular_file, "entry_" + std::to_string(i)});
+	}
+	dir->write_entries(entries);
+	BOOST_REQUIRE(dir->size() > filesystem.block_size() * ext2::directory_iterator<ext2::inodes::directory<decltype(filesystem)> >::blocks_per_read);
+	BOOST_REQUIRE_EQUAL(dir->is_empty(), false);
+
+	// the same entries in the same order as read_entries()
+	entries = dir->read_entries();
+	auto expected = entries.begin();
+	for (const auto &e : dir->entries()) {
+		BOOST_REQUIRE(expected != entries.end());
+		BOOST_CHECK_EQUAL(e.inode_id, expected->inode_id);
+		BOOST_CHECK_EQUAL(e.type, expected->type);
+		BOOST_CHECK_EQUAL(e.name.to_string(), expected->name);
+		BOOST_CHECK(e.to_entry().name == expected->name);
+		++expected;
+	}
+	BOOST_CHECK(expected == entries.end());
+
+	// a search which stops early reads only the first blocks
+	auto reads = image.reads;
+	auto range = dir->entries();
+	auto iter = std::find_if(range.begin(), range.end(), [](const auto &e) { return e.name == "entry_10"; });
+	BOOST_REQUIRE(iter != range.end());
+	BOOST_CHECK_EQUAL(iter->inode_id, file.first);
+	BOOST_CHECK_EQUAL(image.reads - reads, 1);
+	auto copy = iter;
+	BOOST_CHECK(copy == iter);
+	++copy;
+	BOOST_CHECK(copy != iter);
+	BOOST_CHECK_EQUAL(copy->name, "entry_11");
+	BOOST_CHECK(std::find_if(range.begin(), range.end(), [](const auto &e) { return e.name == "missing"; }) == range.end());
+
+	// a visitor reads the directory once, like an iteration
+	auto dir_reads = [&]() {
+		uint32_t result = 0;
+		for (const auto &e : dir->map_extents(0, dir->size())) {
+			auto begin = filesystem.to_address(e.physical, 0);
+			auto end = begin + (static_cast<uint64_t>(e.length) * filesystem.block_size());
+			for (auto iter = image.reads_at.lower_bound(begin); iter != image.reads_at.end() && iter->first < end; ++iter) {
+				result += iter->second;
+			}
+		}
+		return result;
+	};
+	auto before = dir_reads();
+	BOOST_CHECK_EQUAL(std::distance(range.begin(), range.end()), 1002);
+	const auto iteration = dir_reads() - before;
+	before = dir_reads();
+	std::ostringstream printed;
+	ext2::print(printed, *dir);
+	BOOST_CHECK_EQUAL(dir_reads() - before, iteration);
+
+	// directories with entries are not removed
+	auto root = filesystem.get_root();
+	auto *root_dir = ext2::to_directory(&root);
+	*root_dir << ext2::create_directory_entry("iterated", id_dir.first, id_dir.second);
+	BOOST_REQUIRE_EQUAL(root_dir->remove("iterated"), false);
+	BOOST_REQUIRE_EQUAL(root_dir->lookup("iterated"), id_dir.first);
+	std::remove("directory_iterator_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(directory_cookie_test) {
+	std::remove("directory_cookie_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("directory_cookie_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("directory_cookie_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto file = filesystem.create_file();
+	file.second.data.count_hard_link = 1000;
+	file.second.save();
+
+	auto id_dir = filesystem.create_directory(2);
+	auto *dir = ext2::to_directory(&id_dir.second);
+	auto entries = dir->read_entries();
+	for (auto i = 0u; i < 500; i++) {
+		entries.push_back(ext2::detail::directory_entry{file.first, 0, 0, ext2::detail::directory_entry_type::regular_file, "entry_" + std::to_string(i)});
+	}
+	dir->write_entries(entries);
+
+	// lists the directory in pages of 7 entries, like readdir() with a small buffer
+	std::vector<std::string> names;
+	uint64_t cookie = 0;
+	for (bool done = false; !done;) {
+		auto range = dir->entries(cookie);
+		auto iter = range.begin();
+		for (auto i = 0; i < 7 && iter != range.end(); i++, ++iter) {
+			BOOST_REQUIRE(iter.cookie() > cookie);
+			names.push_back(iter->name.to_string());
+			cookie = iter.cookie();
+		}
+		done = iter == range.end();
+	}
+	BOOST_REQUIRE_EQUAL(names.size(), 502);
+	for (auto i = 0u; i < 500; i++) {
+		BOOST_REQUIRE_EQUAL(names[i + 2], "entry_" + std::to_string(i));
+	}
+	BOOST_CHECK(dir->entries(cookie).begin() == dir->entries().end());
+	BOOST_CHECK(dir->entries(dir->size() + 100).begin() == dir->entries().end());
+
+	// the iteration continues at the right entry after changes in front of and at the cookie
+	auto range = dir->entries();
+	auto iter = std::find_if(range.begin(), range.end(), [](const auto &e) { return e.name == "entry_100"; });
+	BOOST_REQUIRE(iter != range.end());
+	cookie = iter.cookie();
+	BOOST_REQUIRE_EQUAL(dir->entries(cookie).begin()->name, "entry_101");
+	BOOST_REQUIRE_EQUAL(dir->remove("entry_100"), true);
+	BOOST_REQUIRE_EQUAL(dir->remove("entry_101"), true);
+	BOOST_REQUIRE_EQUAL(dir->entries(cookie).begin()->name, "entry_102");
+	BOOST_REQUIRE_EQUAL(dir->remove("entry_50"), true);
+	*dir << ext2::detail::directory_entry{file.first, 0, 0, ext2::detail::directory_entry_type::regular_file, "new"};
+	BOOST_REQUIRE_EQUAL(dir->entries(cookie).begin()->name, "entry_102");
+
+	// a listing of an indexed directory is paused in the middle of a leaf, which is split in the meantime
+	const auto block_size = filesystem.block_size();
+	auto id_indexed = filesystem.create_directory(2);
+	auto *indexed = ext2::to_directory(&id_indexed.second);
+	entries = indexed->read_entries();
+	for (auto i = 0u; i < 500; i++) {
+		entries.push_back(ext2::detail::directory_entry{file.first, 0, 0, ext2::detail::directory_entry_type::regular_file, "indexed_" + std::to_string(i)});
+	}
+	indexed->write_entries(entries);
+	BOOST_REQUIRE_EQUAL(indexed->build_index(), true);
+	// the leaves are not sorted by hash anymore
+	for (auto i = 0u; i < 300; i++) {
+		*indexed << ext2::detail::directory_entry{file.first, 0, 0, ext2::detail::directory_entry_type::regular_file, "added_" + std::to_string(i)};
+	}
+	entries = indexed->read_entries();
+	std::set<std::string> seen;
+	auto paused = indexed->entries();
+	auto listed = paused.begin();
+	for (; listed != paused.end() && listed.cookie() < 2 * block_size + block_size / 2; ++listed) {
+		seen.insert(listed->name.to_string());
+	}
+	BOOST_REQUIRE(listed != paused.end());
+	cookie = listed.cookie();
+	seen.insert(listed->name.to_string());
+	// the entries of the leaf with the cookie
+	auto leaf_entries = [&]() {
+		uint32_t result = 0;
+		auto range = indexed->entries(cookie - cookie % block_size);
+		for (auto iter = range.begin(); iter != range.end() && iter.position() < cookie - cookie % block_size + block_size; ++iter) {
+			result++;
+		}
+		return result;
+	};
+	const auto size = indexed->size();
+	for (auto i = 0u, count = leaf_entries(); i < 1000; i++) {
+		*indexed << ext2::detail::directory_entry{file.first, 0, 0, ext2::detail::directory_entry_type::regular_file, "split_" + std::to_string(i)};
+		const auto next = leaf_entries();
+		if (next < count) {
+			break;
+		}
+		count = next;
+	}
+	BOOST_REQUIRE_EQUAL(indexed->is_indexed(), true);
+	BOOST_REQUIRE(indexed->size() > size);
+	auto resumed = indexed->entries(cookie);
+	for (auto iter = resumed.begin(); iter != resumed.end(); ++iter) {
+		const auto name = iter->name.to_string();
+		if (seen.count(name) != 0) {
+			// only entries which were moved into a new leaf are listed again
+			BOOST_CHECK(iter.position() >= size);
+		}
+		seen.insert(name);
+	}
+	// no entry is skipped
+	for (const auto &e : entries) {
+		BOOST_CHECK(seen.count(e.name) == 1);
+	}
+	std::remove("directory_cookie_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(compact_directory_test) {
+	std::remove("compact_directory_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("compact_directory_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("compact_directory_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	const auto block_size = filesystem.block_size();
+	auto file = filesystem.create_file();
+	file.second.data.count_hard_link = 10000;
+	file.second.save();
+	auto entry = [&](const std::string &name) { return ext2::detail::directory_entry{file.first, 0, 0, ext2::detail::directory_entry_type::regular_file, name}; };
+
+	// a linear directory after many removals
+	auto id_dir = filesystem.create_directory(2);
+	auto *dir = ext2::to_directory(&id_dir.second);
+	auto entries = dir->read_entries();
+	for (auto i = 0u; i < 1000; i++) {
+		entries.push_back(entry("entry_" + std::to_string(i)));
+	}
+	dir->write_entries(entries);
+	auto root = filesystem.get_root();
+	*ext2::to_directory(&root) << ext2::create_directory_entry("churned", id_dir.first, id_dir.second);
+	for (auto i = 0u; i < 1000; i++) {
+		if (i % 10 != 0) {
+			BOOST_REQUIRE_EQUAL(dir->remove("entry_" + std::to_string(i)), true);
+		}
+	}
+	const auto old_blocks = dir->size() / block_size;
+	const auto free_blocks = ext2::read_superblock(image).data.free_block_count;
+
+	// the whole tree
+	auto freed = ext2::compact_directories(root);
+	id_dir.second.load();
+	BOOST_REQUIRE(freed > 0);
+	// the data blocks and the indirect block
+	BOOST_REQUIRE_EQUAL(old_blocks - dir->size() / block_size + 1, freed);
+	BOOST_REQUIRE(dir->size() / block_size <= 2);
+	BOOST_REQUIRE_EQUAL(ext2::read_superblock(image).data.free_block_count, free_blocks + freed);
+	auto result = dir->read_entries();
+	BOOST_REQUIRE_EQUAL(result.size(), 102);
+	for (auto i = 0u; i < 100; i++) {
+		BOOST_REQUIRE_EQUAL(result[i + 2].name, "entry_" + std::to_string(i * 10));
+		BOOST_REQUIRE_EQUAL(dir->lookup("entry_" + std::to_string(i * 10)), file.first);
+	}
+	// nothing is written, if it is packed
+	auto writes = image.writes;
+	BOOST_REQUIRE_EQUAL(dir->compact(), 0);
+	BOOST_REQUIRE_EQUAL(image.writes, writes);
+
+	// an indexed directory stays indexed
+	auto id_dir2 = filesystem.create_directory(2);
+	auto *dir2 = ext2::to_directory(&id_dir2.second);
+	entries = dir2->read_entries();
+	for (auto i = 0u; i < 3000; i++) {
+		entries.push_back(entry("file_" + std::to_string(i)));
+	}
+	dir2->write_entries(entries);
+	BOOST_REQUIRE_EQUAL(dir2->build_index(), true);
+	for (auto i = 0u; i < 3000; i++) {
+		if (i % 20 != 0) {
+			BOOST_REQUIRE_EQUAL(dir2->remove("file_" + std::to_string(i)), true);
+		}
+	}
+	const auto indexed_blocks = dir2->size() / block_size;
+	freed = dir2->compact();
+	BOOST_REQUIRE_EQUAL(freed, indexed_blocks - dir2->size() / block_size + 1);
+	BOOST_REQUIRE(dir2->size() / block_size < indexed_blocks / 5);
+	BOOST_REQUIRE_EQUAL(dir2->is_indexed(), true);
+	BOOST_REQUIRE_EQUAL(dir2->read_entries().size(), 152);
+	for (auto i = 0u; i < 3000; i += 20) {
+		BOOST_REQUIRE_EQUAL(dir2->lookup("file_" + std::to_string(i)), file.first);
+	}
+	BOOST_REQUIRE_EQUAL(dir2->compact(), 0);
+	std::remove("compact_directory_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(path_resolver_test) {
+	std::remove("path_resolver_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("path_resolver_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	counting_node<host_node> image("path_resolver_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto add = [&](uint32_t parent, const std::string &name, auto &id_inode) {
+		auto dir = filesystem.get_inode(parent);
+		*ext2::to_directory(&dir) << ext2::create_directory_entry(name, id_inode.first, id_inode.second);
+	};
+
+	// /a/b/file with many siblings on each level
+	auto a = filesystem.create_directory(2);
+	add(2, "a", a);
+	auto b = filesystem.create_directory(a.first);
+	add(a.first, "b", b);
+	auto file = filesystem.create_file();
+	add(b.first, "file", file);
+	for (auto i = 0u; i < 200; i++) {
+		auto sibling = filesystem.create_file();
+		add(a.first, "sibling_" + std::to_string(i), sibling);
+		add(b.first, "sibling_" + std::to_string(i), sibling);
+	}
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/a/b/file"), file.first);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "b/file", true, a.first), file.first);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/a/./b/../b/file"), file.first);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/"), 2);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/a/missing"), 0);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/a/b/file/x"), 0);
+
+	// only the inodes on the path are loaded
+	auto fresh = ext2::read_filesystem(image);
+	auto reads = image.reads;
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(fresh, "/a/b/file"), file.first);
+	BOOST_CHECK(image.reads - reads <= 12);
+
+	// symbolic links are followed relative to their directory or from "/"
+	auto relative = filesystem.create_symbolic_link("b/file");
+	add(a.first, "relative", relative);
+	auto absolute = filesystem.create_symbolic_link("/a/b");
+	add(2, "absolute", absolute);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/a/relative"), file.first);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/a/relative", false), relative.first);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/absolute/file"), file.first);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/absolute"), b.first);
+	auto root = filesystem.get_root();
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(root, "/absolute/file"), file.first);
+	BOOST_REQUIRE_EQUAL(ext2::find_inode(root, "/a/relative", false), relative.first);
+
+	// loops end after max_symlinks links
+	auto loop1 = filesystem.create_symbolic_link("loop2");
+	add(2, "loop1", loop1);
+	auto loop2 = filesystem.create_symbolic_link("/loop1");
+	add(2, "loop2", loop2);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/loop1"), 0);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/loop1/file"), 0);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/loop1", false), loop1.first);
+	// a chain of three links
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/absolute/../relative", true, 2, 2), file.first);
+	auto chain = filesystem.create_symbolic_link("absolute/../relative");
+	add(2, "chain", chain);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/chain", true, 2, 3), file.first);
+	BOOST_REQUIRE_EQUAL(ext2::resolve_path(filesystem, "/chain", true, 2, 2), 0);
+	std::remove("path_resolver_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(inode_cache_truncating_copy_test) {
+	std::remove("inode_cache_truncating_copy_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("inode_cache_truncating_copy_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	host_node image("inode_cache_truncating_copy_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	const uint64_t block_size = filesystem.block_size();
+	auto file = filesystem.create_file();
+	file.second.set_size(20 * block_size);
+
+	// a handle, which has decoded the indirect block
+	auto handle = filesystem.iget(file.first);
+	const auto block12 = handle->map_extents(12 * block_size, block_size)[0].physical;
+
+	// a copy frees all blocks and allocates them again, but the old block 12 is taken
+	auto copy = filesystem.get_inode(file.first);
+	copy.set_size(0);
+	auto taken = filesystem.alloc_block(block12);
+	BOOST_REQUIRE_EQUAL(taken, block12);
+	copy.set_size(20 * block_size);
+
+	auto expected = copy.map_extents(12 * block_size, block_size);
+	auto mapped = handle->map_extents(12 * block_size, block_size);
+	BOOST_REQUIRE_EQUAL(mapped.size(), 1);
+	BOOST_REQUIRE_EQUAL(mapped[0].physical, expected[0].physical);
+	BOOST_REQUIRE(mapped[0].physical != taken);
+
+	// the handle does not write its old indirect block over the new one
+	handle->flush();
+	handle.reset();
+	auto fresh = ext2::read_filesystem(image);
+	auto reloaded = fresh.get_inode(file.first);
+	BOOST_REQUIRE_EQUAL(reloaded.map_extents(12 * block_size, block_size)[0].physical, expected[0].physical);
+	std::remove("inode_cache_truncating_copy_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(read_out_of_range_test) {
+	std::remove("read_out_of_range_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("read_out_of_range_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	host_node image("read_out_of_range_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto file = filesystem.create_file();
+	const std::string content(100, 'x');
+	file.second.write(0, content.data(), content.size());
+	std::vector<char> buffer(200, 0);
+	file.second.read(50, buffer.data(), 50);
+	BOOST_REQUIRE_EQUAL(std::string(buffer.data(), 50), content.substr(50));
+	BOOST_CHECK_THROW(file.second.read(50, buffer.data(), 51), ext2::error::out_of_range_error);
+	BOOST_CHECK_THROW(file.second.read(101, buffer.data(), 0), ext2::error::out_of_range_error);
+
+	// the target of a fast symbolic link is in the inode
+	auto symlink = filesystem.create_symbolic_link("/tmp2/testdir");
+	symlink.second.read(0, buffer.data(), symlink.second.size());
+	BOOST_REQUIRE_EQUAL(std::string(buffer.data(), symlink.second.size()), "/tmp2/testdir");
+	symlink.second.read(6, buffer.data(), 3);
+	BOOST_REQUIRE_EQUAL(std::string(buffer.data(), 3), "tes");
+	std::remove("read_out_of_range_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(import_file_failure_test) {
+	std::remove("import_file_failure_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("import_file_failure_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	host_node image("import_file_failure_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto root = filesystem.get_root();
+	auto *dir = ext2::to_directory(&root);
+	const auto free_blocks = ext2::read_superblock(image).data.free_block_count;
+	const auto free_inodes = ext2::read_superblock(image).data.free_inodes_count;
+
+	// the blocks are allocated, but a directory can not be read like a file
+	::mkdir("import_file_failure_test.dir", 0755);
+	BOOST_CHECK_THROW(ext2::import_file(*dir, "directory", "import_file_failure_test.dir"), ext2::error::host_io_error);
+	// the file does not fit into the image
+	{
+		std::ofstream host("import_file_failure_test.host", std::ios::binary);
+	}
+	BOOST_REQUIRE_EQUAL(::truncate("import_file_failure_test.host", 64 * 1024 * 1024), 0);
+	BOOST_CHECK_THROW(ext2::import_file(*dir, "large", "import_file_failure_test.host"), ext2::error::no_free_block_error);
+
+	BOOST_REQUIRE_EQUAL(ext2::read_superblock(image).data.free_block_count, free_blocks);
+	BOOST_REQUIRE_EQUAL(ext2::read_superblock(image).data.free_inodes_count, free_inodes);
+	BOOST_REQUIRE_EQUAL(dir->lookup("directory"), 0);
+	BOOST_REQUIRE_EQUAL(dir->lookup("large"), 0);
+	::rmdir("import_file_failure_test.dir");
+	std::remove("import_file_failure_test.host");
+	std::remove("import_file_failure_test.img");
+}
+
+BOOST_AUTO_TEST_CASE(discard_import_test) {
+	std::remove("discard_import_test.img");
+	{
+		std::ifstream source("image.img", std::ios::binary);
+    		std::ofstream dest("discard_import_test.img", std::ios::binary);
+		std::istreambuf_iterator<char> begin_source(source);
+		std::istreambuf_iterator<char> end_source;
+		std::ostreambuf_iterator<char> begin_dest(dest); 
+		std::copy(begin_source, end_source, begin_dest);
+	}
+	{
+		std::ofstream host("discard_import_test.host", std::ios::binary);
+		host << std::string(100000, 'x');
+	}
+	host_node image("discard_import_test.img", 1024 * 1024 * 10);
+	auto filesystem = ext2::read_filesystem(image);
+	auto root = filesystem.get_root();
+	auto *dir = ext2::to_directory(&root);
+	const auto free_blocks = ext2::read_superblock(image).data.free_block_count;
+	const auto free_inodes = ext2::read_superblock(image).data.free_inodes_count;
+
+	auto job = ext2::prepare_import(*dir, "prepared", "discard_import_test.host");
+	BOOST_REQUIRE_EQUAL(dir->lookup("prepared"), job.inode_id);
+	BOOST_REQUIRE_EQUAL(job.parent, 2);
+	BOOST_REQUIRE_EQUAL(job.name, "prepared");
+	// the host file is gone before its data is copied
+	std::remove("discard_import_test.host");
+	int image_fd = ::open("discard_import_test.img", O_RDWR);
+	BOOST_REQUIRE(image_fd >= 0);
+	BOOST_CHECK_THROW(ext2::run_import(job, image_fd), ext2::error::host_io_error);
+	::close(image_fd);
+
+	ext2::discard_import(filesystem, job);
+	BOOST_REQUIRE_EQUAL(dir->lookup("prepared"), 0);
+	BOOST_REQUIRE_EQUAL(ext2::read_superblock(image).data.free_block_count, free_blocks);
+	BOOST_REQUIRE_EQUAL(ext2::read_superblock(image).data.free_inodes_count, free_inodes);
+	std::remove("discard_import_test.img");
+}